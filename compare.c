@@ -0,0 +1,297 @@
+/*
+ * File:   compare.c
+ * Author: Matthew
+ *
+ * Workers take bands of rows and produce exact squared error sums and the
+ * SSIM of the windows whose top edge lies in the band. SSIM follows x264:
+ * luma sums are gathered per 4x4 block and every window is four blocks, so
+ * each pixel is read once per band rather than once per window.
+ */
+
+#include "compare.h"
+#include "thread.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define COMPARE_SSE 1
+#endif
+
+// rows per band, a multiple of the 4 row SSIM blocks
+#define BAND_ROWS 64
+// 16 pixel groups summed in 32 bit lanes before they are flushed to 64 bits
+#define FLUSH_GROUPS 32768
+
+typedef struct {
+	unsigned long long sse[3];
+	double ssim;
+} BandResult;
+
+typedef struct {
+	const Color* a;
+	const Color* b;
+	int w;
+	int h;
+	int bands;
+	BandResult* results;
+	volatile long next;
+	volatile long failed;
+} CompareJob;
+
+// per 4x4 block sums of the two luma planes
+typedef struct {
+	int s1;
+	int s2;
+	int ss;
+	int s12;
+} BlockSums;
+
+static void sse_scalar(const unsigned char* a, const unsigned char* b, size_t n, size_t phase, unsigned long long sse[3])
+{
+	for (size_t i=0; i<n; i++) {
+		int d = a[i] - b[i];
+		sse[(phase + i) % 3] += (unsigned long long) (d*d);
+	}
+}
+
+// squared differences of n interleaved samples, starting on a red sample
+static void sse_bytes(const unsigned char* a, const unsigned char* b, size_t n, unsigned long long sse[3])
+{
+	size_t i = 0;
+
+	memset(sse, 0, sizeof(unsigned long long) * 3);
+#ifdef COMPARE_SSE
+	// 48 bytes are 16 whole pixels, so every lane always holds the same channel
+	{
+		const __m128i zero = _mm_setzero_si128();
+		unsigned int lanes[48];
+		__m128i acc[12];
+		size_t groups = 0;
+
+		for (int k=0; k<12; k++)
+			acc[k] = zero;
+		for (; i+48 <= n; i += 48) {
+			for (int v=0; v<3; v++) {
+				__m128i x = _mm_loadu_si128((const __m128i*) (a + i + v*16));
+				__m128i y = _mm_loadu_si128((const __m128i*) (b + i + v*16));
+				__m128i d = _mm_or_si128(_mm_subs_epu8(x, y), _mm_subs_epu8(y, x));
+				__m128i lo = _mm_unpacklo_epi8(d, zero);
+				__m128i hi = _mm_unpackhi_epi8(d, zero);
+				lo = _mm_mullo_epi16(lo, lo);
+				hi = _mm_mullo_epi16(hi, hi);
+				acc[v*4] = _mm_add_epi32(acc[v*4], _mm_unpacklo_epi16(lo, zero));
+				acc[v*4+1] = _mm_add_epi32(acc[v*4+1], _mm_unpackhi_epi16(lo, zero));
+				acc[v*4+2] = _mm_add_epi32(acc[v*4+2], _mm_unpacklo_epi16(hi, zero));
+				acc[v*4+3] = _mm_add_epi32(acc[v*4+3], _mm_unpackhi_epi16(hi, zero));
+			}
+			if (++groups == FLUSH_GROUPS || i+96 > n) {
+				for (int k=0; k<12; k++) {
+					_mm_storeu_si128((__m128i*) (lanes + k*4), acc[k]);
+					acc[k] = zero;
+				}
+				for (int l=0; l<48; l++)
+					sse[l % 3] += lanes[l];
+				groups = 0;
+			}
+		}
+	}
+#endif
+	sse_scalar(a + i, b + i, n - i, i % 3, sse);
+}
+
+// adds four rows of luma into the per column sums
+static void column_sums(const Color* a, const Color* b, int w, int* s1, int* s2, int* ss, int* s12)
+{
+	memset(s1, 0, sizeof(int) * w);
+	memset(s2, 0, sizeof(int) * w);
+	memset(ss, 0, sizeof(int) * w);
+	memset(s12, 0, sizeof(int) * w);
+
+	for (int r=0; r<4; r++) {
+		const Color* pa = a + (size_t) r*w;
+		const Color* pb = b + (size_t) r*w;
+		for (int x=0; x<w; x++) {
+			int ya = (77*pa[x].r + 150*pa[x].g + 29*pa[x].b + 128) >> 8;
+			int yb = (77*pb[x].r + 150*pb[x].g + 29*pb[x].b + 128) >> 8;
+			s1[x] += ya;
+			s2[x] += yb;
+			ss[x] += ya*ya + yb*yb;
+			s12[x] += ya*yb;
+		}
+	}
+}
+
+static void block_row(const CompareJob* job, int by, int* cols, BlockSums* out)
+{
+	int w = job->w;
+	int* s1 = cols;
+	int* s2 = cols + w;
+	int* ss = cols + w*2;
+	int* s12 = cols + w*3;
+	size_t first = (size_t) by*4*w;
+
+	column_sums(job->a + first, job->b + first, w, s1, s2, ss, s12);
+	for (int bx=0; bx<w/4; bx++) {
+		int x = bx*4;
+		out[bx].s1 = s1[x] + s1[x+1] + s1[x+2] + s1[x+3];
+		out[bx].s2 = s2[x] + s2[x+1] + s2[x+2] + s2[x+3];
+		out[bx].ss = ss[x] + ss[x+1] + ss[x+2] + ss[x+3];
+		out[bx].s12 = s12[x] + s12[x+1] + s12[x+2] + s12[x+3];
+	}
+}
+
+// SSIM of one 8x8 window from its summed blocks
+static double ssim_window(double s1, double s2, double ss, double s12)
+{
+	static const double c1 = .01*.01*255*255*64;
+	static const double c2 = .03*.03*255*255*64*63;
+	double vars = ss*64 - s1*s1 - s2*s2;
+	double covar = s12*64 - s1*s2;
+
+	return (2*s1*s2 + c1) * (2*covar + c2) / ((s1*s1 + s2*s2 + c1) * (vars + c2));
+}
+
+static double ssim_rows(const BlockSums* top, const BlockSums* bottom, int bw)
+{
+	double sum = 0;
+
+	for (int bx=0; bx+1<bw; bx++) {
+		sum += ssim_window(
+			top[bx].s1 + top[bx+1].s1 + bottom[bx].s1 + bottom[bx+1].s1,
+			top[bx].s2 + top[bx+1].s2 + bottom[bx].s2 + bottom[bx+1].s2,
+			top[bx].ss + top[bx+1].ss + bottom[bx].ss + bottom[bx+1].ss,
+			top[bx].s12 + top[bx+1].s12 + bottom[bx].s12 + bottom[bx+1].s12);
+	}
+	return sum;
+}
+
+static void* compare_worker(void* arg)
+{
+	CompareJob* job = arg;
+	int bw = job->w / 4;
+	int bh = job->h / 4;
+	int* cols = malloc(sizeof(int) * 4 * job->w);
+	BlockSums* top = malloc(sizeof(BlockSums) * (bw + 1));
+	BlockSums* bottom = malloc(sizeof(BlockSums) * (bw + 1));
+	long long span = trace_begin();
+	long band;
+
+	if (!cols || !top || !bottom) {
+		atomic_store(&job->failed, 1);
+		goto done;
+	}
+
+	while ((band = atomic_add(&job->next, 1)) < job->bands) {
+		BandResult* r = &job->results[band];
+		int y0 = (int) band * BAND_ROWS;
+		int y1 = y0 + BAND_ROWS < job->h ? y0 + BAND_ROWS : job->h;
+		size_t first = (size_t) y0 * job->w;
+
+		sse_bytes((const unsigned char*) (job->a + first), (const unsigned char*) (job->b + first),
+			(size_t) (y1 - y0) * job->w * sizeof(Color), r->sse);
+
+		// windows whose top block row is in this band, the last needs the next band's first
+		r->ssim = 0;
+		if (bw < 2 || y0/4 + 1 >= bh)
+			continue;
+		block_row(job, y0/4, cols, top);
+		for (int by=y0/4; by<y1/4 && by+1<bh; by++) {
+			BlockSums* t = top;
+			block_row(job, by+1, cols, bottom);
+			r->ssim += ssim_rows(top, bottom, bw);
+			top = bottom;
+			bottom = t;
+		}
+	}
+
+done:
+	free(cols);
+	free(top);
+	free(bottom);
+	trace_end("compare_bands", span);
+	return NULL;
+}
+
+int compare_images(CompareResult* r, const Color* a, const Color* b, int w, int h, int threads)
+{
+	CompareJob job;
+	thread_t* pool;
+	int started = 0;
+	unsigned long long sse[3] = {0, 0, 0};
+	double ssim = 0;
+
+	memset(r, 0, sizeof(CompareResult));
+	if (w < 1 || h < 1)
+		return -1;
+
+	job.a = a;
+	job.b = b;
+	job.w = w;
+	job.h = h;
+	job.bands = (h + BAND_ROWS - 1) / BAND_ROWS;
+	job.next = 0;
+	job.failed = 0;
+	job.results = calloc(job.bands, sizeof(BandResult));
+	if (!job.results)
+		return -1;
+
+	if (threads < 1)
+		threads = thread_count();
+	if (threads > job.bands)
+		threads = job.bands;
+
+	long long span = trace_begin();
+	pool = malloc(sizeof(thread_t)*threads);
+	if (pool) {
+		for (int i=1; i<threads; i++)
+			if (thread_create(&pool[started], compare_worker, &job) == 0)
+				started++;
+	}
+	compare_worker(&job);
+	for (int i=0; i<started; i++)
+		thread_join(pool[i]);
+	free(pool);
+	trace_end("compare_images", span);
+
+	// reduced in band order so the result doesn't depend on the thread count
+	for (int i=0; i<job.bands; i++) {
+		for (int c=0; c<3; c++)
+			sse[c] += job.results[i].sse[c];
+		ssim += job.results[i].ssim;
+	}
+	free(job.results);
+	if (job.failed)
+		return -1;
+
+	r->pixels = (unsigned long long) w*h;
+	for (int c=0; c<3; c++)
+		r->mse[c] = (double) sse[c] / r->pixels;
+	r->mse_total = (double) (sse[0] + sse[1] + sse[2]) / (r->pixels*3);
+	r->psnr = r->mse_total > 0 ? 10 * log10(255.0*255.0 / r->mse_total) : INFINITY;
+	r->ssim = w >= 8 && h >= 8 ? ssim / ((double) (w/4 - 1) * (h/4 - 1)) : NAN;
+
+	return 0;
+}
+
+// infinite and undefined values have no JSON form, they are written as null
+static void write_number(FILE* fp, const char* name, double v, const char* after)
+{
+	if (isfinite(v))
+		fprintf(fp, "  \"%s\": %.6f%s", name, v, after);
+	else
+		fprintf(fp, "  \"%s\": null%s", name, after);
+}
+
+void compare_write_json(const CompareResult* r, FILE* fp)
+{
+	fprintf(fp, "{\n  \"pixels\": %llu,\n  \"mse_channels\": [%.6f, %.6f, %.6f],\n",
+		r->pixels, r->mse[0], r->mse[1], r->mse[2]);
+	write_number(fp, "mse", r->mse_total, ",\n");
+	write_number(fp, "psnr", r->psnr, ",\n");
+	write_number(fp, "ssim", r->ssim, "\n");
+	fprintf(fp, "}\n");
+}
@@ -0,0 +1,26 @@
+/* 
+ * File:   compare.h
+ * Author: Matthew
+ *
+ * Difference metrics between two images of the same size.
+ */
+
+#ifndef COMPARE_H
+#define COMPARE_H
+
+#include <stdio.h>
+
+#include "ezview.h"
+
+typedef struct {
+	unsigned long long pixels;
+	double mse[3];      // per channel
+	double mse_total;   // over all three channels
+	double psnr;        // dB from mse_total, INFINITY for identical images
+	double ssim;        // mean over 8x8 luma windows with a stride of 4, NAN below 8x8
+} CompareResult;
+
+int compare_images(CompareResult* r, const Color* a, const Color* b, int w, int h, int threads);
+void compare_write_json(const CompareResult* r, FILE* fp);
+
+#endif
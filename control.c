@@ -0,0 +1,422 @@
+/*
+ * File:   control.c
+ * Author: Matthew
+ *
+ * The I/O thread owns every socket and only blocks in poll, so a slow or
+ * stalled client never holds up the render thread. Each queue has exactly
+ * one writer and one reader, which is all the atomics in thread.h need.
+ */
+
+#include "control.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#define GLFW_DLL 1
+#include <GLFW/glfw3.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+#endif
+
+#define LINE_SIZE 4096
+
+// parses one command line, returns an error message or NULL
+static const char* control_parse(char* line, ControlCommand* cmd)
+{
+	char name[16];
+	char* rest;
+	int n = 0;
+
+	memset(cmd, 0, sizeof(ControlCommand));
+	if (sscanf(line, "%15s%n", name, &n) != 1)
+		return "empty command";
+	rest = line + n;
+	while (*rest == ' ' || *rest == '\t')
+		rest++;
+
+	if (!strcmp(name, "key")) {
+		char key[16];
+		cmd->type = CONTROL_KEY;
+		cmd->count = 1;
+		if (sscanf(rest, "%15s %d", key, &cmd->count) < 1 || cmd->count < 1)
+			return "usage: key NAME [COUNT]";
+		if (!strcmp(key, "up"))
+			cmd->key = GLFW_KEY_UP;
+		else if (!strcmp(key, "down"))
+			cmd->key = GLFW_KEY_DOWN;
+		else if (!strcmp(key, "left"))
+			cmd->key = GLFW_KEY_LEFT;
+		else if (!strcmp(key, "right"))
+			cmd->key = GLFW_KEY_RIGHT;
+		else if (!strcmp(key, "escape"))
+			cmd->key = GLFW_KEY_ESCAPE;
+		else if (!key[1] && isalnum((unsigned char) key[0]))
+			cmd->key = toupper((unsigned char) key[0]);     // GLFW letter and digit codes are ASCII
+		else
+			return "unknown key";
+	} else if (!strcmp(name, "set")) {
+		float* v = cmd->values;
+		cmd->type = CONTROL_SET;
+		if (sscanf(rest, "%f %f %f %f %f %f %f %f", v, v+1, v+2, v+3, v+4, v+5, v+6, v+7) != 8)
+			return "usage: set X0 Y0 X1 Y1 X2 Y2 X3 Y3";
+	} else if (!strcmp(name, "compose")) {
+		float* v = cmd->values;
+		cmd->type = CONTROL_COMPOSE;
+		if (sscanf(rest, "%f %f %f %f %f %f", v, v+1, v+2, v+3, v+4, v+5) != 6)
+			return "usage: compose A B C D E F";
+	} else if (!strcmp(name, "load") || !strcmp(name, "capture")) {
+		cmd->type = name[0] == 'l' ? CONTROL_LOAD : CONTROL_CAPTURE;
+		if (!*rest)
+			return "missing path";
+		cmd->path = malloc(strlen(rest) + 1);
+		if (!cmd->path)
+			return "out of memory";
+		strcpy(cmd->path, rest);
+	} else if (!strcmp(name, "stats")) {
+		cmd->type = CONTROL_STATS;
+	} else if (!strcmp(name, "sync")) {
+		cmd->type = CONTROL_SYNC;
+	} else {
+		return "unknown command";
+	}
+
+	return NULL;
+}
+
+ControlCommand* control_peek(Control* c)
+{
+	long head = c->command_head;
+
+	if (head == atomic_load(&c->command_tail))
+		return NULL;
+	return &c->commands[head & (CONTROL_QUEUE - 1)];
+}
+
+void control_pop(Control* c)
+{
+	long head = c->command_head;
+
+	free(c->commands[head & (CONTROL_QUEUE - 1)].path);
+	atomic_store(&c->command_head, head + 1);
+}
+
+int control_reply_room(Control* c)
+{
+	return (int) (CONTROL_REPLIES - (c->reply_tail - atomic_load(&c->reply_head)));
+}
+
+void control_reply(Control* c, const ControlCommand* cmd, const char* text)
+{
+	long tail = c->reply_tail;
+	ControlReply* r;
+
+	// callers check control_reply_room first, this only guards the ring
+	if (tail - atomic_load(&c->reply_head) == CONTROL_REPLIES)
+		return;
+	r = &c->replies[tail & (CONTROL_REPLIES - 1)];
+	r->text = malloc(strlen(text) + 1);
+	if (!r->text)
+		return;
+	strcpy(r->text, text);
+	r->client = cmd->client;
+	r->serial = cmd->serial;
+	atomic_store(&c->reply_tail, tail + 1);
+	c->replies_queued = 1;
+}
+
+#ifndef _WIN32
+
+void control_flush(Control* c)
+{
+	if (c->replies_queued) {
+		c->replies_queued = 0;
+		if (write(c->wake[1], "r", 1) < 0)
+			return;
+	}
+}
+
+static void send_all(int fd, const char* text, size_t len)
+{
+	while (len > 0) {
+		ssize_t n = send(fd, text, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		text += n;
+		len -= (size_t) n;
+	}
+}
+
+// closes whatever control_start opened before it failed, the path is
+// only removed if the socket there is ours
+static int start_failed(Control* c)
+{
+	if (c->listen_fd >= 0)
+		close(c->listen_fd);
+	if (c->bound)
+		unlink(c->path);
+	if (c->wake[0] >= 0) {
+		close(c->wake[0]);
+		close(c->wake[1]);
+	}
+	c->listen_fd = -1;
+	c->bound = 0;
+	c->wake[0] = c->wake[1] = -1;
+	return -1;
+}
+
+static void close_client(Control* c, int slot)
+{
+	close(c->clients[slot]);
+	c->clients[slot] = -1;
+	c->line_len[slot] = 0;
+}
+
+// waits for room in the command ring, which only fills if rendering falls behind
+static int push_command(Control* c, const ControlCommand* cmd)
+{
+	long tail = c->command_tail;
+
+	while (tail - atomic_load(&c->command_head) == CONTROL_QUEUE) {
+		if (atomic_load(&c->stop))
+			return -1;
+		usleep(500);
+	}
+	c->commands[tail & (CONTROL_QUEUE - 1)] = *cmd;
+	atomic_store(&c->command_tail, tail + 1);
+	return 0;
+}
+
+// splits whatever has arrived into lines and queues them
+static int read_client(Control* c, int slot)
+{
+	char* buf = c->lines[slot];
+	size_t start = 0;
+	ssize_t n = read(c->clients[slot], buf + c->line_len[slot], LINE_SIZE - 1 - c->line_len[slot]);
+
+	if (n <= 0)
+		return n < 0 && errno == EINTR ? 0 : -1;
+	c->line_len[slot] += (size_t) n;
+
+	for (size_t i=0; i<c->line_len[slot]; i++) {
+		ControlCommand cmd;
+		const char* error;
+
+		if (buf[i] != '\n')
+			continue;
+		buf[i] = '\0';
+		if (i > start && buf[i-1] == '\r')
+			buf[i-1] = '\0';
+
+		// errors go through the queue too, so replies keep the order of the lines
+		error = control_parse(buf + start, &cmd);
+		if (error) {
+			free(cmd.path);
+			cmd.path = NULL;
+			cmd.type = CONTROL_ERROR;
+			cmd.error = error;
+		}
+		cmd.client = slot;
+		cmd.serial = c->serials[slot];
+		if (push_command(c, &cmd)) {
+			free(cmd.path);
+			return -1;
+		}
+		start = i + 1;
+	}
+
+	// keep the unfinished line, a line that fills the buffer is dropped
+	c->line_len[slot] -= start;
+	memmove(buf, buf + start, c->line_len[slot]);
+	if (c->line_len[slot] == LINE_SIZE - 1)
+		c->line_len[slot] = 0;
+	return 0;
+}
+
+static void send_replies(Control* c)
+{
+	long head = c->reply_head;
+
+	while (head != atomic_load(&c->reply_tail)) {
+		ControlReply* r = &c->replies[head & (CONTROL_REPLIES - 1)];
+		// the client may have gone and its slot been reused
+		if (c->clients[r->client] >= 0 && c->serials[r->client] == r->serial)
+			send_all(c->clients[r->client], r->text, strlen(r->text));
+		free(r->text);
+		atomic_store(&c->reply_head, ++head);
+	}
+}
+
+static void* control_worker(void* arg)
+{
+	Control* c = arg;
+	struct pollfd fds[2 + CONTROL_CLIENTS];
+	int slots[2 + CONTROL_CLIENTS];
+
+	trace_thread_name("control");
+	while (!atomic_load(&c->stop)) {
+		int n = 2;
+
+		fds[0].fd = c->listen_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = c->wake[0];
+		fds[1].events = POLLIN;
+		for (int i=0; i<CONTROL_CLIENTS; i++) {
+			if (c->clients[i] < 0)
+				continue;
+			fds[n].fd = c->clients[i];
+			fds[n].events = POLLIN;
+			slots[n++] = i;
+		}
+
+		if (poll(fds, n, -1) < 0)
+			continue;
+
+		if (fds[1].revents & POLLIN) {
+			char drain[64];
+			if (read(c->wake[0], drain, sizeof(drain)) < 0 && errno != EAGAIN)
+				break;
+			send_replies(c);
+		}
+
+		if (fds[0].revents & POLLIN) {
+			int fd = accept(c->listen_fd, NULL, NULL);
+			int slot = -1;
+			for (int i=0; i<CONTROL_CLIENTS && fd >= 0; i++) {
+				if (c->clients[i] < 0) {
+					slot = i;
+					break;
+				}
+			}
+			if (slot >= 0) {
+				c->clients[slot] = fd;
+				c->serials[slot]++;
+				c->line_len[slot] = 0;
+			} else if (fd >= 0) {
+				send_all(fd, "error too many clients\n", 23);
+				close(fd);
+			}
+		}
+
+		for (int i=2; i<n; i++) {
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+				if (read_client(c, slots[i]))
+					close_client(c, slots[i]);
+		}
+	}
+
+	return NULL;
+}
+
+int control_start(Control* c, const char* path)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+
+	memset(c, 0, sizeof(Control));
+	c->path = path;
+	c->listen_fd = -1;
+	c->wake[0] = c->wake[1] = -1;
+	for (int i=0; i<CONTROL_CLIENTS; i++)
+		c->clients[i] = -1;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr.sun_path))
+		return -1;
+	strcpy(addr.sun_path, path);
+
+	c->commands = malloc(sizeof(ControlCommand) * CONTROL_QUEUE);
+	c->replies = malloc(sizeof(ControlReply) * CONTROL_REPLIES);
+	for (int i=0; i<CONTROL_CLIENTS; i++)
+		if (!(c->lines[i] = malloc(LINE_SIZE)))
+			return -1;
+	if (!c->commands || !c->replies)
+		return -1;
+
+	// a socket left behind by an earlier run is replaced, anything else is not
+	if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path);
+
+	c->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (c->listen_fd < 0 || bind(c->listen_fd, (struct sockaddr*) &addr, sizeof(addr)))
+		return start_failed(c);
+	c->bound = 1;
+	if (listen(c->listen_fd, CONTROL_CLIENTS) || pipe(c->wake))
+		return start_failed(c);
+	fcntl(c->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(c->wake[1], F_SETFL, O_NONBLOCK);
+
+	if (thread_create(&c->thread, control_worker, c))
+		return start_failed(c);
+	c->started = 1;
+	return 0;
+}
+
+void control_stop(Control* c)
+{
+	if (c->started) {
+		atomic_store(&c->stop, 1);
+		// a full pipe wakes the thread just as well
+		if (write(c->wake[1], "s", 1) < 0 && errno != EAGAIN)
+			fprintf(stderr, "Error: Could not stop the control thread.\n");
+		thread_join(c->thread);
+	}
+
+	while (control_peek(c))
+		control_pop(c);
+	while (c->reply_head != c->reply_tail)
+		free(c->replies[c->reply_head++ & (CONTROL_REPLIES - 1)].text);
+
+	for (int i=0; i<CONTROL_CLIENTS; i++) {
+		if (c->clients[i] >= 0)
+			close(c->clients[i]);
+		free(c->lines[i]);
+	}
+	if (c->listen_fd >= 0)
+		close(c->listen_fd);
+	if (c->bound)
+		unlink(c->path);
+	if (c->wake[0] >= 0) {
+		close(c->wake[0]);
+		close(c->wake[1]);
+	}
+	free(c->commands);
+	free(c->replies);
+	memset(c, 0, sizeof(Control));
+}
+
+#else
+
+// no Unix domain sockets in this build
+int control_start(Control* c, const char* path)
+{
+	memset(c, 0, sizeof(Control));
+	return -1;
+}
+
+void control_flush(Control* c)
+{
+	c->replies_queued = 0;
+}
+
+void control_stop(Control* c)
+{
+	memset(c, 0, sizeof(Control));
+}
+
+#endif
@@ -0,0 +1,101 @@
+/* 
+ * File:   control.h
+ * Author: Matthew
+ *
+ * Unix domain socket for driving the viewer from scripts. An I/O thread reads
+ * line commands from clients and posts them to the render thread through a
+ * lock-free queue, which the render thread drains once per frame.
+ *
+ * Commands, one per line:
+ *   key NAME [COUNT]      same as pressing NAME (a letter, up, down, left,
+ *                         right or escape) COUNT times
+ *   set X0 Y0 ... X3 Y3   sets the four quad corners
+ *   compose A B C D E F   maps every corner (x, y) to (Ax + By + E, Cx + Dy + F)
+ *   load PATH             shows another image
+ *   capture PATH          saves the next frame as PPM, or QOI for .qoi
+ *   stats                 replies with the image stats as JSON
+ *   sync                  replies 'ok FRAME' once everything before it is applied
+ * load replies 'ok WxH' once the image is up or 'error MESSAGE', capture
+ * 'ok' or an error, stats as above or an error when no stats thread is
+ * running, and sync as above. key, set and compose only reply when
+ * malformed, with 'error MESSAGE' like every other command.
+ */
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include "thread.h"
+
+// queued commands and replies, powers of two
+#define CONTROL_QUEUE 4096
+#define CONTROL_REPLIES 256
+#define CONTROL_CLIENTS 8
+
+typedef enum {
+	CONTROL_KEY,
+	CONTROL_SET,
+	CONTROL_COMPOSE,
+	CONTROL_LOAD,
+	CONTROL_CAPTURE,
+	CONTROL_STATS,
+	CONTROL_SYNC,
+	CONTROL_ERROR           // a malformed line, answered in turn like the rest
+} ControlType;
+
+typedef struct {
+	ControlType type;
+	int client;             // slot and serial the reply goes back to
+	unsigned serial;
+	int key;
+	int count;
+	float values[8];
+	char* path;             // load and capture, freed by control_pop unless taken
+	const char* error;      // CONTROL_ERROR, a static message
+} ControlCommand;
+
+typedef struct {
+	int client;
+	unsigned serial;
+	char* text;
+} ControlReply;
+
+typedef struct {
+	const char* path;
+	int listen_fd;
+	int bound;              // the socket at path was made by this process, so it's removed on stop
+	int wake[2];            // the render thread pokes the I/O thread when replies are queued
+	int clients[CONTROL_CLIENTS];
+	unsigned serials[CONTROL_CLIENTS];
+	char* lines[CONTROL_CLIENTS];
+	size_t line_len[CONTROL_CLIENTS];
+
+	// single producer, single consumer rings: commands from the I/O thread,
+	// replies from the render thread
+	ControlCommand* commands;
+	volatile long command_head;
+	volatile long command_tail;
+	ControlReply* replies;
+	volatile long reply_head;
+	volatile long reply_tail;
+	int replies_queued;
+
+	volatile long stop;
+	int started;
+	thread_t thread;
+} Control;
+
+// binds the socket at path and starts the I/O thread
+int control_start(Control* c, const char* path);
+// render thread: next command or NULL; it stays queued until control_pop
+ControlCommand* control_peek(Control* c);
+void control_pop(Control* c);
+// render thread: free slots in the reply ring, commands that may reply are
+// only taken while there is one
+int control_reply_room(Control* c);
+// render thread: queues a copy of text for the client that sent cmd
+void control_reply(Control* c, const ControlCommand* cmd, const char* text);
+// render thread: hands this frame's replies to the I/O thread
+void control_flush(Control* c);
+void control_stop(Control* c);
+
+#endif
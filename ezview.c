@@ -13,36 +13,82 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <ctype.h>
 #include <math.h>
 #include <assert.h>
 
-#define CHANNEL_SIZE 255
+#include "ezview.h"
+#include "compare.h"
+#include "control.h"
+#include "filter.h"
+#include "layers.h"
+#include "ppm.h"
+#include "pool.h"
+#include "progcache.h"
+#include "qoi.h"
+#include "replay.h"
+#include "stats.h"
+#include "thread.h"
+#include "trace.h"
+#include "upload.h"
 
 typedef struct {
 	float position[2];
 	float TexCoord[2];
 } Vertex;
 
-typedef struct {
-    unsigned char r;
-    unsigned char g;
-    unsigned char b;
-} Color;
-
-FILE* sourcefp;
-char format;
 int h;
 int w;
-int mc;
-char c;
 Color* image;
+int show_histogram = 1;
+int view_request = 0;
+int compare_view = 0;   // side by side, flicker or heatmap when comparing two images
+const char* trace_path = NULL;
+Replay replay;
 
-void read_data_to_buffer();
-void skip_ws(FILE*);
+// part of the file being shown, x, y, width, height in file pixels
+int view_rect[4];
+int file_w;
+int file_h;
+
+// decodes and filters the source again off the render thread
+typedef struct {
+	PpmDecoder* decoder;
+	const char* source;
+	const char* filter;
+	int threads;
+	int reopen;         // open the file again in case it changed on disk
+	int rect[4];        // part of the file to decode
+	int file_w;
+	int file_h;
+	Color* pixels;
+	int w;
+	int h;
+	char error[160];
+	int started;
+	thread_t thread;
+	volatile long done;
+} ReloadTask;
+
+int apply_filter(const char*, Color**, int*, int*, int);
+int batch_stats(const char**, int, const char*, int);
+int batch_convert(const char**, int, const char*, int);
+static void* reload_worker(void*);
+Color* decode_view(PpmDecoder*, const int[4]);
+int parse_rect(const char*, int[4]);
+void visible_rect(const int[4], int[4]);
+void refit_quad(const int[4], const int[4]);
+void compose_quad(const float[6]);
+void quad_transform(float[6]);
+int capture_frame(const char*, int, int);
+char* json_escape(const char*);
+void reply_stats(Control*, const ControlCommand*, const char*, const ImageStats*, long, double);
+static void write_trace();
 static void error_callback(int, const char*);
 static void key_callback(GLFWwindow*, int, int, int, int);
-void glCompileShaderOrDie(GLuint);
+static void size_callback(GLFWwindow*, int, int);
+void upload_histogram(const ImageStats*, GLuint);
 
 Vertex vertices[] = {
 	{{1, -1}, {0.99999, 0.99999}},
@@ -51,6 +97,14 @@ Vertex vertices[] = {
 	{{-1, -1}, {0, 0.99999}}
 };
 
+// bottom left corner, texture y runs up so it can be compared with bin heights
+Vertex histogram_vertices[] = {
+	{{-0.5, -0.95}, {1, 0}},
+	{{-0.5, -0.55}, {1, 1}},
+	{{-0.95, -0.55}, {0, 1}},
+	{{-0.95, -0.95}, {0, 0}}
+};
+
 const GLubyte indices[] = {
   0, 1, 2,
   2, 3, 0
@@ -74,85 +128,247 @@ static const char* fragment_shader_text =
 "    gl_FragColor = texture2D(Texture, TexCoordOut);\n"
 "}\n";
 
+// difference of the two images, black through red and yellow to white over a
+// dimmed copy of the first where they match
+static const char* heatmap_fragment_text =
+"varying mediump vec2 TexCoordOut;\n"
+"uniform sampler2D Texture;\n"
+"uniform sampler2D Other;\n"
+"void main()\n"
+"{\n"
+"    mediump vec3 a = texture2D(Texture, TexCoordOut).rgb;\n"
+"    mediump vec3 d = abs(a - texture2D(Other, TexCoordOut).rgb);\n"
+"    mediump float m = clamp(max(d.r, max(d.g, d.b)) * 8.0, 0.0, 1.0);\n"
+"    mediump vec3 heat = clamp(vec3(3.0*m, 3.0*m - 1.0, 3.0*m - 2.0), 0.0, 1.0);\n"
+"    mediump vec3 base = vec3(dot(a, vec3(0.299, 0.587, 0.114)) * 0.25);\n"
+"    gl_FragColor = vec4(mix(base, heat, step(0.001, m)), 1.0);\n"
+"}\n";
+
+// Texture is a 256x1 strip holding each channel's normalized bin height
+static const char* histogram_fragment_text =
+"varying mediump vec2 TexCoordOut;\n"
+"uniform sampler2D Texture;\n"
+"void main()\n"
+"{\n"
+"    lowp vec3 height = texture2D(Texture, vec2(TexCoordOut.x, 0.5)).rgb;\n"
+"    gl_FragColor = vec4(step(vec3(TexCoordOut.y), height), 0.75);\n"
+"}\n";
+
 int main(int argc, char** argv)
 {
-	// check for correct number of inputs
-    if (argc != 2) {
-        fprintf(stderr, "Error: Arguments should be in format: 'format' 'source' 'dest'.");
-        return(1);
-    }
+    const char** sources = calloc(argc, sizeof(char*));
+    int source_count = 0;
+    const char* source = NULL;
+    const char* dest = NULL;
+    const char* filter = NULL;
+    int json = 0;
+    int convert = 0;
+    int compare = 0;
+    double max_mse = -1;
+    int threads = 0;
+    int reserve = 0;
+    int pool_counters = 0;
+    UploadFormat upload_format = UPLOAD_AUTO;
+    double upload_budget = 4;
+    StatsTask stats;
+    ReloadTask reload;
+    UploadScheduler scheduler;
+    Color* pending = NULL;
+    const char* crop = NULL;
+    const char* control_path = NULL;
+    const char* record_path = NULL;
+    const char* replay_path = NULL;
+    int replay_real_time = 0;
+    int hidden = 0;
+    LayerStack layers;
     
-    // open source file
-    sourcefp = fopen(argv[1], "rb");
+    memset(&layers, 0, sizeof(LayerStack));
+    // read options, the remaining arguments are sources
+    for (int i=1; i<argc && sources; i++) {
+        if (!strcmp(argv[i], "-f") && i+1 < argc) {
+            filter = argv[++i];
+        } else if (!strcmp(argv[i], "-o") && i+1 < argc) {
+            dest = argv[++i];
+        } else if (!strcmp(argv[i], "-j")) {
+            json = 1;
+        } else if (!strcmp(argv[i], "-q")) {
+            convert = 1;
+        } else if (!strcmp(argv[i], "-d")) {
+            compare = 1;
+        } else if (!strcmp(argv[i], "-e") && i+1 < argc) {
+            max_mse = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-t") && i+1 < argc) {
+            threads = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-R") && i+1 < argc) {
+            reserve = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-m")) {
+            pool_counters = 1;
+        } else if (!strcmp(argv[i], "-u") && i+1 < argc && upload_parse_format(argv[i+1], &upload_format) == 0) {
+            i++;
+        } else if (!strcmp(argv[i], "-b") && i+1 < argc) {
+            upload_budget = atof(argv[++i]);
+        } else if (!strcmp(argv[i], "-c") && i+1 < argc) {
+            crop = argv[++i];
+        } else if (!strcmp(argv[i], "-T") && i+1 < argc) {
+            trace_path = argv[++i];
+        } else if (!strcmp(argv[i], "-S") && i+1 < argc) {
+            control_path = argv[++i];
+        } else if (!strcmp(argv[i], "-r") && i+1 < argc) {
+            record_path = argv[++i];
+        } else if ((!strcmp(argv[i], "-p") || !strcmp(argv[i], "-P")) && i+1 < argc) {
+            replay_real_time = argv[i][1] == 'P';
+            replay_path = argv[++i];
+        } else if (!strcmp(argv[i], "-H")) {
+            hidden = 1;
+        } else if (!strcmp(argv[i], "-l") && i+1 < argc) {
+            if (layers_parse(&layers, argv[++i])) {
+                fprintf(stderr, "Error: Invalid layer '%s'. Use 'PATH[:OPACITY[:A,B,C,D,E,F]]', up to %d layers.", argv[i], LAYER_MAX);
+                return(1);
+            }
+        } else if (argv[i][0] != '-') {
+            sources[source_count++] = argv[i];
+        } else {
+            source_count = 0;
+            break;
+        }
+    }
     
-    // check that source exists
-    if (!sourcefp) {
-        fprintf(stderr, "Error: File not found.");
+	// check for correct number of inputs, only json stats and conversion take several
+    // and comparing takes exactly two
+    if (source_count < 1 || (source_count > 1 && !compare && (dest || !(json || convert))) || (convert && (dest || json))
+            || (compare && (source_count != 2 || dest || convert)) || (max_mse >= 0 && !compare) || (record_path && replay_path)
+            || (layers.count && (compare || dest || json || convert))) {
+        fprintf(stderr, "Error: Arguments should be in format: [-f filter] [-o dest] [-j | -q] [-d [-e max mse]] [-t threads] [-R buffers] [-m] [-u auto|rgb|rgba|565] [-b upload ms] [-T trace.json] [-S socket] [-r record | -p replay | -P replay] [-H] [-l layer ...] [-c x,y,w,h] 'source' ['source' ... with -j, -q or -d].");
         return(1);
     }
+    // the trace is written however main exits
+    if (trace_path) {
+        trace_start();
+        trace_thread_name("main");
+        atexit(write_trace);
+    }
+    pool_init(POOL_HUGE, (size_t) 1 << 30);
+    if (convert || (source_count > 1 && !compare)) {
+        int status = convert ? batch_convert(sources, source_count, filter, threads)
+                             : batch_stats(sources, source_count, filter, threads);
+        if (pool_counters)
+            pool_write_json(stderr);
+        return(status);
+    }
+    source = sources[0];
     
-    skip_ws(sourcefp);
-	
-    // checks that source is either P3 or P6
-    if (fgetc(sourcefp) != 'P') {
-        fprintf(stderr, "Error: Invalid image format. '%s' needs to be either 'P3' or 'P6'.", argv[1]);
+    // decode source, or just the crop of it; the decoder stays open for
+    // later crops from the viewer
+    PpmDecoder decoder;
+    long long span = trace_begin();
+    if (ppm_open_path(&decoder, source) || ppm_read_header(&decoder)) {
+        fprintf(stderr, "Error: '%s': %s", source, decoder.error);
         return(1);
     }
-    // saves input format
-    format = fgetc(sourcefp);
-    if (format != '3' && format != '6') {
-        fprintf(stderr, "Error: Invalid image format. '%s' needs to be either 'P3' or 'P6'.", argv[1]);
+    file_w = decoder.w;
+    file_h = decoder.h;
+    view_rect[0] = 0;
+    view_rect[1] = 0;
+    view_rect[2] = file_w;
+    view_rect[3] = file_h;
+    if (crop && (parse_rect(crop, view_rect) || view_rect[0] + view_rect[2] > file_w || view_rect[1] + view_rect[3] > file_h)) {
+        fprintf(stderr, "Error: Crop '%s' must be x,y,w,h inside the %dx%d image.", crop, file_w, file_h);
         return(1);
     }
-    
-    // initialize c and move through whitespace
-    skip_ws(sourcefp);
-    c = fgetc(sourcefp);
-	
-    // check for comments
-    while (c == '#') {
-        while (c != '\n')
-            c = fgetc(sourcefp);
-        
-		while(isspace(c))
-			c = fgetc(sourcefp);
+    image = decode_view(&decoder, view_rect);
+    trace_end("load", span);
+    if (!image) {
+        fprintf(stderr, "Error: '%s': %s", source, decoder.error);
+        return(1);
     }
+    w = view_rect[2];
+    h = view_rect[3];
     
-	ungetc(c, sourcefp);
-	
-    // get width and height
-    fscanf(sourcefp, "%d", &w);
-    fscanf(sourcefp, "%d", &h);
-	
-    // check width and height
-    if (h < 1 || w < 1) {
-        fprintf(stderr, "Error: Invalid dimensions.");
+    // prefault spare buffers for reloads and filtering
+    if (reserve > 0 && pool_reserve(sizeof(Color)*w*h, reserve))
+        fprintf(stderr, "Error: Could not reserve %d image buffers.\n", reserve);
+    
+    // run the cpu filter before anything is uploaded
+    if (filter && apply_filter(filter, &image, &w, &h, threads)) {
+        fprintf(stderr, "Error: Invalid filter '%s'. Use 'blur:SIGMA', 'sharpen:SIGMA[:AMOUNT]' or 'resize:WxH'.", filter);
         return(1);
     }
     
-    // get channel size
-    fscanf(sourcefp, "%d", &mc);
-    // check channel size
-    if (mc != CHANNEL_SIZE) {
-        fprintf(stderr, "Error: Channel size must be 8 bits.");
-        return(1);
+    // the second image gets the same crop and filter as the first
+    Color* other = NULL;
+    CompareResult diff;
+    if (compare) {
+        PpmDecoder other_decoder;
+        const char* other_source = sources[1];
+        int ow = view_rect[2];
+        int oh = view_rect[3];
+        
+        if (ppm_open_path(&other_decoder, other_source) || ppm_read_header(&other_decoder)) {
+            fprintf(stderr, "Error: '%s': %s", other_source, other_decoder.error);
+            return(1);
+        }
+        if (other_decoder.w != file_w || other_decoder.h != file_h) {
+            fprintf(stderr, "Error: '%s' is %dx%d, it must be the same size as '%s'.", other_source, other_decoder.w, other_decoder.h, source);
+            return(1);
+        }
+        other = decode_view(&other_decoder, view_rect);
+        if (!other) {
+            fprintf(stderr, "Error: '%s': %s", other_source, other_decoder.error);
+            return(1);
+        }
+        ppm_close(&other_decoder);
+        if (filter && apply_filter(filter, &other, &ow, &oh, threads)) {
+            fprintf(stderr, "Error: Invalid filter '%s'.", filter);
+            return(1);
+        }
+        
+        if (compare_images(&diff, image, other, w, h, threads)) {
+            fprintf(stderr, "Error: Out of memory.");
+            return(1);
+        }
+        compare_write_json(&diff, stdout);
+        
+        // headless check, exits with 2 when the images differ by more than allowed
+        if (json || max_mse >= 0) {
+            pool_free(image);
+            pool_free(other);
+            ppm_close(&decoder);
+            if (pool_counters)
+                pool_write_json(stderr);
+            return(max_mse >= 0 && diff.mse_total > max_mse ? 2 : 0);
+        }
     }
     
-    image = malloc(sizeof(Color)*h*w);
-	
-    // skip white space before data is read
-    fgetc(sourcefp);
-    read_data_to_buffer();
-    // close source
-    fclose(sourcefp);
+    // headless export, no window needed
+    if (dest || json) {
+        if (dest && (qoi_path(dest) ? qoi_write(dest, image, w, h) : ppm_write(dest, image, w, h))) {
+            fprintf(stderr, "Error: Could not write '%s'.", dest);
+            return(1);
+        }
+        if (json) {
+            stats_compute(&stats.stats, image, w, h, threads);
+            stats_write_json(&stats.stats, stdout);
+        }
+        pool_free(image);
+        ppm_close(&decoder);
+        if (pool_counters)
+            pool_write_json(stderr);
+        return(0);
+    }
+    
+    // histogram is filled in while the window comes up
+    stats_start(&stats, image, w, h, threads);
 	
     GLFWwindow* window;
-    GLuint vertex_buffer, vertex_shader, fragment_shader, program;
-	GLuint index_buffer;
+    GLuint vertex_buffer, program;
+	GLuint index_buffer, histogram_buffer, histogram_program, histID;
+	GLuint heatmap_program = 0, otherID = 0;
+	int histogram_uploaded = 0;
     GLint mvp_location, vpos_location, vcol_location;
 
     glfwSetErrorCallback(error_callback);
 
+    span = trace_begin();
     if (!glfwInit())
         exit(EXIT_FAILURE);
 
@@ -161,17 +377,24 @@ int main(int argc, char** argv)
 	glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
 	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 0);
+	// replays can run without showing anything
+	if (hidden)
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 
-    window = glfwCreateWindow(w, h, "Image Viewer", NULL, NULL);
+    // room for both images next to each other when comparing
+    window = glfwCreateWindow(other ? w*2 : w, h, "Image Viewer", NULL, NULL);
     if (!window) {
         glfwTerminate();
         exit(EXIT_FAILURE);
     }
 
     glfwSetKeyCallback(window, key_callback);
+    glfwSetWindowSizeCallback(window, size_callback);
 
     glfwMakeContextCurrent(window);
     glfwSwapInterval(1);
+    trace_end("context_create", span);
+    progcache_init();
 
     glGenBuffers(1, &vertex_buffer);
     glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
@@ -181,18 +404,12 @@ int main(int argc, char** argv)
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
 	glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(indices), indices, GL_STATIC_DRAW);
 
-    vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    glShaderSource(vertex_shader, 1, &vertex_shader_text, NULL);
-    glCompileShaderOrDie(vertex_shader);
-
-    fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    glShaderSource(fragment_shader, 1, &fragment_shader_text, NULL);
-    glCompileShaderOrDie(fragment_shader);
+	glGenBuffers(1, &histogram_buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, histogram_buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(histogram_vertices), histogram_vertices, GL_STATIC_DRAW);
 
-    program = glCreateProgram();
-    glAttachShader(program, vertex_shader);
-    glAttachShader(program, fragment_shader);
-    glLinkProgram(program);
+    program = build_program(vertex_shader_text, fragment_shader_text);
+    histogram_program = build_program(vertex_shader_text, histogram_fragment_text);
 
     vpos_location = glGetAttribLocation(program, "vPos");
     assert(vpos_location != -1);
@@ -203,18 +420,229 @@ int main(int argc, char** argv)
     GLint tex_location = glGetUniformLocation(program, "Texture");
     assert(tex_location != -1);
 
+    GLint hist_vpos_location = glGetAttribLocation(histogram_program, "vPos");
+    GLint hist_texcoord_location = glGetAttribLocation(histogram_program, "TexCoordIn");
+    GLint hist_tex_location = glGetUniformLocation(histogram_program, "Texture");
+    assert(hist_vpos_location != -1 && hist_texcoord_location != -1 && hist_tex_location != -1);
+
     glEnableVertexAttribArray(vpos_location);
     glEnableVertexAttribArray(texcoord_location);
+    glEnableVertexAttribArray(hist_vpos_location);
+    glEnableVertexAttribArray(hist_texcoord_location);
 
-    GLuint texID;
-    glGenTextures(1, &texID);
-    glBindTexture(GL_TEXTURE_2D, texID);
+    glGenTextures(1, &histID);
+    glBindTexture(GL_TEXTURE_2D, histID);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
+    // the image is uploaded in bands across the first frames
+    if (upload_format == UPLOAD_AUTO)
+        upload_format = upload_probe();
+    
+    // the second image never changes, so it goes up in one piece
+    GLint heat_vpos_location = -1, heat_texcoord_location = -1, heat_tex_location = -1, heat_other_location = -1;
+    if (other) {
+        heatmap_program = build_program(vertex_shader_text, heatmap_fragment_text);
+        heat_vpos_location = glGetAttribLocation(heatmap_program, "vPos");
+        heat_texcoord_location = glGetAttribLocation(heatmap_program, "TexCoordIn");
+        heat_tex_location = glGetUniformLocation(heatmap_program, "Texture");
+        heat_other_location = glGetUniformLocation(heatmap_program, "Other");
+        assert(heat_vpos_location != -1 && heat_texcoord_location != -1 && heat_tex_location != -1 && heat_other_location != -1);
+        glEnableVertexAttribArray(heat_vpos_location);
+        glEnableVertexAttribArray(heat_texcoord_location);
+        
+        glGenTextures(1, &otherID);
+        glBindTexture(GL_TEXTURE_2D, otherID);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        if (upload_texture(upload_format, other, w, h))
+            fprintf(stderr, "Error: Could not upload '%s'.\n", sources[1]);
+    }
+    upload_scheduler_init(&scheduler, upload_format, upload_budget / 1000);
+    
+    // layers are all uploaded before the first frame and never change
+    if (layers_init(&layers, upload_format, threads)) {
+        fprintf(stderr, "Error: %s", layers.error);
+        return(1);
+    }
+    upload_scheduler_start(&scheduler, image, w, h);
+    
+    memset(&reload, 0, sizeof(ReloadTask));
+    reload.decoder = &decoder;
+    reload.source = source;
+    reload.filter = filter;
+    reload.threads = threads;
+    
+    // script commands come in on their own thread and are applied between frames
+    Control control;
+    ControlCommand capture_cmd;
+    char* capture_path = NULL;
+    char* loaded_source = NULL;
+    int control_loading = 0;
+    long frames = 0;
+    double frame_time = 0, last_frame = glfwGetTime();
+    if (control_path && control_start(&control, control_path)) {
+        fprintf(stderr, "Error: Could not listen on '%s'.\n", control_path);
+        control_stop(&control);
+        control_path = NULL;
+    }
+    
+    // the session clock starts with the first frame
+    if (record_path) {
+        int ww, wh;
+        if (replay_record(&replay, record_path, glfwGetTime())) {
+            fprintf(stderr, "Error: Could not write '%s'.", record_path);
+            return(1);
+        }
+        glfwGetWindowSize(window, &ww, &wh);
+        replay_size(&replay, glfwGetTime(), ww, wh);
+    } else if (replay_path && replay_play(&replay, replay_path, replay_real_time, glfwGetTime())) {
+        fprintf(stderr, "Error: '%s' is not a recording.", replay_path);
+        return(1);
+    }
 
     while (!glfwWindowShouldClose(window)) {
+		long long frame_span = trace_begin();
+		span = frame_span;
+		
+		// replayed input goes through the same callbacks as the real thing
+		ReplayEvent event;
+		while (replay_next(&replay, glfwGetTime(), &event)) {
+			if (event.type == REPLAY_KEY)
+				key_callback(window, event.key, event.scancode, event.action, event.mods);
+			else if (event.type == REPLAY_SIZE)
+				glfwSetWindowSize(window, event.w, event.h);
+			else
+				glfwSetWindowShouldClose(window, GLFW_TRUE);
+		}
+		
+		// everything queued since the last frame is applied in order; a load
+		// holds back what follows until the new image is up, and a capture,
+		// an early stats query or a full reply ring waits for the next frame.
+		// The slot a load or capture was taken with is still free when it
+		// replies, nothing else is taken until then
+		ControlCommand* cmd;
+		if (control_loading && !reload.started && !scheduler.active) {
+			char reply[200];
+			if (reload.error[0])
+				snprintf(reply, sizeof(reply), "error %s\n", reload.error);
+			else
+				snprintf(reply, sizeof(reply), "ok %dx%d\n", file_w, file_h);
+			control_reply(&control, &capture_cmd, reply);
+			control_loading = 0;
+		}
+		while (control_path && !capture_path && !control_loading && control_reply_room(&control) && (cmd = control_peek(&control))) {
+			char reply[200];
+			
+			if (cmd->type == CONTROL_KEY) {
+				for (int i=0; i<cmd->count; i++)
+					key_callback(window, cmd->key, 0, GLFW_PRESS, 0);
+			} else if (cmd->type == CONTROL_SET) {
+				for (int i=0; i<4; i++) {
+					vertices[i].position[0] = cmd->values[i*2];
+					vertices[i].position[1] = cmd->values[i*2+1];
+				}
+			} else if (cmd->type == CONTROL_COMPOSE) {
+				compose_quad(cmd->values);
+			} else if (cmd->type == CONTROL_LOAD && other) {
+				control_reply(&control, cmd, "error can't load while comparing\n");
+			} else if (cmd->type == CONTROL_LOAD) {
+				if (reload.started || scheduler.active)
+					break;
+				free(loaded_source);
+				loaded_source = cmd->path;
+				cmd->path = NULL;
+				source = reload.source = loaded_source;
+				view_request = 'L';
+				control_loading = 1;
+				capture_cmd = *cmd;
+			} else if (cmd->type == CONTROL_CAPTURE) {
+				capture_path = cmd->path;
+				cmd->path = NULL;
+				capture_cmd = *cmd;
+			} else if (cmd->type == CONTROL_STATS && !stats.started) {
+				control_reply(&control, cmd, "error no stats are being computed\n");
+			} else if (cmd->type == CONTROL_STATS) {
+				if (!stats_ready(&stats))
+					break;
+				reply_stats(&control, cmd, source, &stats.stats, frames, frame_time);
+			} else if (cmd->type == CONTROL_SYNC) {
+				snprintf(reply, sizeof(reply), "ok %ld\n", frames);
+				control_reply(&control, cmd, reply);
+			} else if (cmd->type == CONTROL_ERROR) {
+				snprintf(reply, sizeof(reply), "error %s\n", cmd->error);
+				control_reply(&control, cmd, reply);
+			}
+			control_pop(&control);
+		}
+		trace_end("control_commands", span);
+		
+		// R decodes the file again in the background, C decodes just the
+		// visible part at full resolution and F goes back to the whole file;
+		// the two images of a comparison always stay as loaded
+		if (other)
+			view_request = 0;
+		span = trace_begin();
+		if (view_request && !reload.started && !scheduler.active) {
+			// compressed sources can't go back, so they're opened again too
+			reload.reopen = view_request == 'R' || view_request == 'L' || !ppm_seekable(&decoder);
+			if (view_request == 'C') {
+				visible_rect(view_rect, reload.rect);
+			} else if (view_request == 'F' || view_request == 'L') {
+				reload.rect[0] = 0;
+				reload.rect[1] = 0;
+				reload.rect[2] = file_w;
+				reload.rect[3] = file_h;
+			} else {
+				memcpy(reload.rect, view_rect, sizeof(view_rect));
+			}
+			reload.done = 0;
+			reload.started = thread_create(&reload.thread, reload_worker, &reload) == 0;
+			if (!reload.started) {
+				snprintf(reload.error, sizeof(reload.error), "Could not start the reload thread.");
+				fprintf(stderr, "Error: '%s': %s\n", source, reload.error);
+			}
+		}
+		view_request = 0;
+		if (reload.started && atomic_load(&reload.done)) {
+			thread_join(reload.thread);
+			reload.started = 0;
+			if (reload.pixels) {
+				pending = reload.pixels;
+				upload_scheduler_start(&scheduler, pending, reload.w, reload.h);
+			} else {
+				fprintf(stderr, "Error: '%s': %s\n", source, reload.error);
+			}
+		}
+		
+		trace_end("reload_poll", span);
+		
+		// the old texture stays up until the new one is complete
+		span = trace_begin();
+		if (upload_scheduler_step(&scheduler) && pending) {
+			stats_finish(&stats);
+			pool_free(image);
+			image = pending;
+			w = reload.w;
+			h = reload.h;
+			pending = NULL;
+			
+			// keep the part of the image that was on screen where it was
+			refit_quad(view_rect, reload.rect);
+			memcpy(view_rect, reload.rect, sizeof(view_rect));
+			file_w = reload.file_w;
+			file_h = reload.file_h;
+			histogram_uploaded = 0;
+			stats_start(&stats, image, w, h, threads);
+		}
+		trace_end("upload_step", span);
+		
+		span = trace_begin();
+		glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
 		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
         int width, height;
 
@@ -229,66 +657,535 @@ int main(int argc, char** argv)
 		glVertexAttribPointer(texcoord_location, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) (sizeof(float) * 2));
 		
 		glActiveTexture(GL_TEXTURE0);
-		glBindTexture(GL_TEXTURE_2D, texID);
+		glBindTexture(GL_TEXTURE_2D, upload_scheduler_texture(&scheduler));
 		glUniform1i(tex_location, 0);
 		
-		glDrawElements(GL_TRIANGLES, sizeof(indices) / sizeof(GLubyte), GL_UNSIGNED_BYTE, 0);
+		if (scheduler.ready && !other) {
+			glDrawElements(GL_TRIANGLES, sizeof(indices) / sizeof(GLubyte), GL_UNSIGNED_BYTE, 0);
+			
+			// layers are placed in file pixels, so they pan, zoom and crop with the image
+			if (layers.count) {
+				float base[6];
+				quad_transform(base);
+				layers_draw(&layers, base);
+			}
+		} else if (scheduler.ready && compare_view == 0) {
+			// both halves share the quad, so they pan and zoom together
+			glViewport(0, 0, width/2, height);
+			glDrawElements(GL_TRIANGLES, sizeof(indices) / sizeof(GLubyte), GL_UNSIGNED_BYTE, 0);
+			glViewport(width/2, 0, width - width/2, height);
+			glBindTexture(GL_TEXTURE_2D, otherID);
+			glDrawElements(GL_TRIANGLES, sizeof(indices) / sizeof(GLubyte), GL_UNSIGNED_BYTE, 0);
+		} else if (scheduler.ready) {
+			// one image at a time in the middle, swapping twice a second or as a heatmap
+			glViewport(width/4, 0, width/2, height);
+			if (compare_view == 1 && (int) (glfwGetTime() * 2) % 2) {
+				glBindTexture(GL_TEXTURE_2D, otherID);
+			} else if (compare_view == 2) {
+				glUseProgram(heatmap_program);
+				glVertexAttribPointer(heat_vpos_location, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) 0);
+				glVertexAttribPointer(heat_texcoord_location, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) (sizeof(float) * 2));
+				glUniform1i(heat_tex_location, 0);
+				glActiveTexture(GL_TEXTURE1);
+				glBindTexture(GL_TEXTURE_2D, otherID);
+				glUniform1i(heat_other_location, 1);
+				glActiveTexture(GL_TEXTURE0);
+			}
+			glDrawElements(GL_TRIANGLES, sizeof(indices) / sizeof(GLubyte), GL_UNSIGNED_BYTE, 0);
+		}
+		glViewport(0, 0, width, height);
+		
+		trace_end("draw", span);
+		
+		// histogram overlay once the background stats are in
+		span = trace_begin();
+		if (!histogram_uploaded && stats_ready(&stats)) {
+			upload_histogram(&stats.stats, histID);
+			histogram_uploaded = 1;
+		}
+		if (histogram_uploaded && show_histogram) {
+			glUseProgram(histogram_program);
+			glBindBuffer(GL_ARRAY_BUFFER, histogram_buffer);
+			glVertexAttribPointer(hist_vpos_location, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) 0);
+			glVertexAttribPointer(hist_texcoord_location, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*) (sizeof(float) * 2));
+			glBindTexture(GL_TEXTURE_2D, histID);
+			glUniform1i(hist_tex_location, 0);
+			
+			glEnable(GL_BLEND);
+			glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+			glDrawElements(GL_TRIANGLES, sizeof(indices) / sizeof(GLubyte), GL_UNSIGNED_BYTE, 0);
+			glDisable(GL_BLEND);
+		}
+		trace_end("histogram_overlay", span);
+		
+		// read back before the swap, while the back buffer still holds the frame
+		if (capture_path) {
+			span = trace_begin();
+			if (capture_frame(capture_path, width, height))
+				control_reply(&control, &capture_cmd, "error could not write capture\n");
+			else
+				control_reply(&control, &capture_cmd, "ok\n");
+			free(capture_path);
+			capture_path = NULL;
+			trace_end("capture", span);
+		}
+		if (control_path)
+			control_flush(&control);
 
+		span = trace_begin();
         glfwSwapBuffers(window);
+		trace_end("swap", span);
+		
+		span = trace_begin();
 		glfwSetKeyCallback(window, key_callback);
         glfwPollEvents();
+		trace_end("poll_events", span);
+		trace_end("frame", frame_span);
+		
+		frames++;
+		frame_time = glfwGetTime() - last_frame;
+		last_frame += frame_time;
+		if (replay.recording || replay.playing)
+			replay_frame(&replay, frame_time);
     }
+    
+    // frame times for comparing runs of the same session
+    if (replay.recording || replay.playing) {
+        replay_write_stats(&replay, stdout);
+        replay_close(&replay, glfwGetTime());
+    }
+    
+    if (control_path)
+        control_stop(&control);
+    free(capture_path);
 
+    // drop a reload that finished or was mid upload when the window closed
+    if (reload.started) {
+        thread_join(reload.thread);
+        pool_free(reload.pixels);
+    }
+    pool_free(pending);
+    pool_free(other);
+    if (otherID)
+        glDeleteTextures(1, &otherID);
+    upload_scheduler_destroy(&scheduler);
+    layers_destroy(&layers);
     glfwDestroyWindow(window);
+    stats_finish(&stats);
+    pool_free(image);
+    ppm_close(&decoder);
+    free(loaded_source);
+    if (pool_counters)
+        pool_write_json(stderr);
 
     glfwTerminate();
     exit(EXIT_SUCCESS);
 }
 
-// reads data from input file into buffer
-void read_data_to_buffer()
+// replaces pixels with the filtered result, which may change width and height
+int apply_filter(const char* spec, Color** pixels, int* width, int* height, int threads)
 {
-    Color color;
-	
-    // if input is P3
-    if (format == '3') {
-        for(int i=0; i<(h*w); i++) {
-			int temp;
-            // reads chars into Color color's rgb spots
-			fscanf(sourcefp, "%d", &temp);
-			color.r = (unsigned char) temp;
-			
-			fscanf(sourcefp, "%d", &temp);
-			color.g = (unsigned char) temp;
-			
-			fscanf(sourcefp, "%d", &temp);
-			color.b = (unsigned char) temp;
-            // puts Color into image buffer
-            image[i] = color;
+    Filter f;
+    Color* filtered;
+    
+    if (filter_parse(&f, spec, *width, *height))
+        return(1);
+    
+    filtered = pool_alloc(sizeof(Color)*f.x.out_len*f.y.out_len);
+    if (!filtered || filter_apply(&f, *pixels, filtered, threads)) {
+        pool_free(filtered);
+        filter_free(&f);
+        return(1);
+    }
+    
+    pool_free(*pixels);
+    *pixels = filtered;
+    *width = f.x.out_len;
+    *height = f.y.out_len;
+    filter_free(&f);
+    return(0);
+}
+
+static void* reload_worker(void* arg)
+{
+    ReloadTask* task = arg;
+    PpmDecoder* decoder = task->decoder;
+    long long span = trace_begin();
+    
+    trace_thread_name("reload");
+    task->error[0] = '\0';
+    task->pixels = NULL;
+    
+    if (task->reopen) {
+        int full = task->rect[2] == decoder->w && task->rect[3] == decoder->h;
+        ppm_close(decoder);
+        if (ppm_open_path(decoder, task->source) == 0 && ppm_read_header(decoder) == 0) {
+            // the file may have changed size, keep the crop inside it
+            if (full || task->rect[0] + task->rect[2] > decoder->w || task->rect[1] + task->rect[3] > decoder->h) {
+                task->rect[0] = 0;
+                task->rect[1] = 0;
+                task->rect[2] = decoder->w;
+                task->rect[3] = decoder->h;
+            }
+            task->pixels = decode_view(decoder, task->rect);
+        }
+    } else {
+        task->pixels = decode_view(decoder, task->rect);
+    }
+    task->file_w = decoder->w;
+    task->file_h = decoder->h;
+    task->w = task->rect[2];
+    task->h = task->rect[3];
+    
+    if (!task->pixels) {
+        snprintf(task->error, sizeof(task->error), "%s", decoder->error);
+    } else if (task->filter && apply_filter(task->filter, &task->pixels, &task->w, &task->h, task->threads)) {
+        pool_free(task->pixels);
+        task->pixels = NULL;
+        snprintf(task->error, sizeof(task->error), "Invalid filter '%s'.", task->filter);
+    }
+    
+    trace_end("reload", span);
+    atomic_store(&task->done, 1);
+    return NULL;
+}
+
+// decodes rect of the file into a new pool buffer
+Color* decode_view(PpmDecoder* decoder, const int rect[4])
+{
+    Color* pixels = pool_alloc(sizeof(Color) * rect[2] * rect[3]);
+    int status;
+    
+    if (!pixels)
+        return(NULL);
+    
+    // whole images are read front to back, crops only touch their rows
+    if (rect[2] == decoder->w && rect[3] == decoder->h)
+        status = ppm_decode_rows(decoder, 0, decoder->h, pixels);
+    else
+        status = ppm_decode_rect(decoder, rect[0], rect[1], rect[2], rect[3], pixels);
+    
+    if (status) {
+        pool_free(pixels);
+        return(NULL);
+    }
+    return(pixels);
+}
+
+// reads 'x,y,w,h'
+int parse_rect(const char* text, int rect[4])
+{
+    if (sscanf(text, "%d,%d,%d,%d", &rect[0], &rect[1], &rect[2], &rect[3]) != 4)
+        return(1);
+    return(rect[0] < 0 || rect[1] < 0 || rect[2] < 1 || rect[3] < 1);
+}
+
+// texture coordinates of a window position, inverting the quad's transform
+static int quad_uv(float x, float y, float* u, float* v)
+{
+    // vertices 2, 1 and 3 hold texture corners (0,0), (1,0) and (0,1)
+    float ex = vertices[1].position[0] - vertices[2].position[0];
+    float ey = vertices[1].position[1] - vertices[2].position[1];
+    float fx = vertices[3].position[0] - vertices[2].position[0];
+    float fy = vertices[3].position[1] - vertices[2].position[1];
+    float det = ex*fy - ey*fx;
+    float dx = x - vertices[2].position[0];
+    float dy = y - vertices[2].position[1];
+    
+    if (fabs(det) < 1e-12)
+        return(1);
+    *u = (dx*fy - dy*fx) / det;
+    *v = (ex*dy - ey*dx) / det;
+    return(0);
+}
+
+// part of the file under the window, in file pixels
+void visible_rect(const int view[4], int out[4])
+{
+    static const float corners[4][2] = {{-1, -1}, {1, -1}, {1, 1}, {-1, 1}};
+    float u0 = 1, v0 = 1, u1 = 0, v1 = 0;
+    
+    memcpy(out, view, sizeof(int)*4);
+    for (int i=0; i<4; i++) {
+        float u, v;
+        if (quad_uv(corners[i][0], corners[i][1], &u, &v))
+            return;
+        u0 = fmin(u0, u);
+        v0 = fmin(v0, v);
+        u1 = fmax(u1, u);
+        v1 = fmax(v1, v);
+    }
+    
+    u0 = fmax(u0, 0);
+    v0 = fmax(v0, 0);
+    u1 = fmin(u1, 1);
+    v1 = fmin(v1, 1);
+    if (u0 >= u1 || v0 >= v1)
+        return;
+    
+    out[0] = view[0] + (int) floor(u0 * view[2]);
+    out[1] = view[1] + (int) floor(v0 * view[3]);
+    out[2] = view[0] + (int) ceil(u1 * view[2]) - out[0];
+    out[3] = view[1] + (int) ceil(v1 * view[3]) - out[1];
+}
+
+// moves the quad so that the new rect lands where it was drawn inside the old one
+void refit_quad(const int from[4], const int to[4])
+{
+    static const float corners[4][2] = {{1, 1}, {1, 0}, {0, 0}, {0, 1}};
+    float ox = vertices[2].position[0];
+    float oy = vertices[2].position[1];
+    float ex = vertices[1].position[0] - ox;
+    float ey = vertices[1].position[1] - oy;
+    float fx = vertices[3].position[0] - ox;
+    float fy = vertices[3].position[1] - oy;
+    
+    for (int i=0; i<4; i++) {
+        float u = (to[0] + corners[i][0]*to[2] - from[0]) / from[2];
+        float v = (to[1] + corners[i][1]*to[3] - from[1]) / from[3];
+        vertices[i].position[0] = ox + u*ex + v*fx;
+        vertices[i].position[1] = oy + u*ey + v*fy;
+    }
+}
+
+// maps every corner (x, y) to (ax + by + e, cx + dy + f)
+void compose_quad(const float m[6])
+{
+    for (int i=0; i<4; i++) {
+        float x = vertices[i].position[0];
+        float y = vertices[i].position[1];
+        vertices[i].position[0] = m[0]*x + m[1]*y + m[4];
+        vertices[i].position[1] = m[2]*x + m[3]*y + m[5];
+    }
+}
+
+// the (ax + by + e, cx + dy + f) that takes file pixels to where the quad draws them
+void quad_transform(float m[6])
+{
+    float ox = vertices[2].position[0];
+    float oy = vertices[2].position[1];
+    
+    m[0] = (vertices[1].position[0] - ox) / view_rect[2];
+    m[1] = (vertices[3].position[0] - ox) / view_rect[3];
+    m[2] = (vertices[1].position[1] - oy) / view_rect[2];
+    m[3] = (vertices[3].position[1] - oy) / view_rect[3];
+    m[4] = ox - m[0]*view_rect[0] - m[1]*view_rect[1];
+    m[5] = oy - m[2]*view_rect[0] - m[3]*view_rect[1];
+}
+
+// writes the framebuffer to path, PPM or QOI by extension
+int capture_frame(const char* path, int width, int height)
+{
+    unsigned char* rgba = pool_alloc((size_t) width*height*4);
+    Color* pixels = pool_alloc(sizeof(Color)*width*height);
+    int status = -1;
+    
+    if (rgba && pixels) {
+        glPixelStorei(GL_PACK_ALIGNMENT, 4);
+        glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
+        
+        // GL rows run bottom up
+        for (int y=0; y<height; y++) {
+            const unsigned char* src = rgba + (size_t) (height-1-y)*width*4;
+            Color* dst = pixels + (size_t) y*width;
+            for (int x=0; x<width; x++) {
+                dst[x].r = src[x*4];
+                dst[x].g = src[x*4+1];
+                dst[x].b = src[x*4+2];
+            }
         }
+        status = qoi_path(path) ? qoi_write(path, pixels, width, height) : ppm_write(path, pixels, width, height);
+    }
+    
+    pool_free(rgba);
+    pool_free(pixels);
+    return status;
+}
+
+// text as the inside of a JSON string, in a new buffer for the caller to free
+char* json_escape(const char* text)
+{
+    char* out = malloc(strlen(text) * 6 + 1);
+    char* o = out;
+    
+    if (!out)
+        return NULL;
+    for (const unsigned char* p = (const unsigned char*) text; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            *o++ = '\\';
+            *o++ = (char) *p;
+        } else if (*p < 0x20) {
+            o += sprintf(o, "\\u%04x", *p);
+        } else {
+            *o++ = (char) *p;
+        }
+    }
+    *o = '\0';
+    return out;
+}
+
+// stats reply for the control socket, formatted in memory
+void reply_stats(Control* control, const ControlCommand* cmd, const char* source, const ImageStats* stats, long frames, double frame_time)
+{
+    char* name = json_escape(source);
+    size_t size = (name ? strlen(name) : 0) + 200 + STATS_JSON_SIZE;
+    char* text = malloc(size);
+    int n;
+    
+    if (!name || !text) {
+        control_reply(control, cmd, "error out of memory\n");
+        free(name);
+        free(text);
+        return;
+    }
+    n = snprintf(text, size, "{\"source\": \"%s\", \"width\": %d, \"height\": %d, \"frames\": %ld, \"frame_ms\": %.3f, \"stats\":\n",
+        name, w, h, frames, frame_time*1000);
+    n += stats_format_json(stats, text + n, size - n);
+    snprintf(text + n, size - n, "}\n");
+    control_reply(control, cmd, text);
+    free(name);
+    free(text);
+}
+
+typedef struct {
+    const char** sources;
+    const char* filter;
+    ImageStats* stats;
+    char (*errors)[160];
+    int count;
+    int convert;        // write each source out as QOI instead of computing stats
+    volatile long next;
+} BatchJob;
+
+// source path with its extension swapped for .qoi
+static const char* qoi_dest(const char* source, char* dest, size_t size)
+{
+    const char* dot = strrchr(source, '.');
+    const char* slash = strrchr(source, '/');
+    int n = dot && (!slash || dot > slash) ? (int) (dot - source) : (int) strlen(source);
+    
+    snprintf(dest, size, "%.*s.qoi", n, source);
+    return dest;
+}
+
+// each worker decodes whole files with its own decoder
+static void* batch_worker(void* arg)
+{
+    BatchJob* job = arg;
+    long i;
+    
+    trace_thread_name("batch");
+    while ((i = atomic_add(&job->next, 1)) < job->count) {
+        long long span = trace_begin();
+        PpmDecoder decoder;
+        Color* pixels = ppm_load(&decoder, job->sources[i]);
+        char dest[1024];
+        int width = decoder.w;
+        int height = decoder.h;
         
-    // if input is P6
-	} else {
-		for(int i=0; i<(h*w); i++) {
-			// reads chars into Color color's rgb spots
-			color.r = fgetc(sourcefp);
-			color.g = fgetc(sourcefp);
-			color.b = fgetc(sourcefp);
-			// puts Color into image buffer
-			image[i] = color;
-		}
-	}
+        if (!pixels)
+            snprintf(job->errors[i], sizeof(job->errors[i]), "%s", decoder.error);
+        else if (job->filter && apply_filter(job->filter, &pixels, &width, &height, 1))
+            snprintf(job->errors[i], sizeof(job->errors[i]), "Invalid filter '%s'.", job->filter);
+        else if (!job->convert)
+            stats_compute(&job->stats[i], pixels, width, height, 1);
+        else if (qoi_write(qoi_dest(job->sources[i], dest, sizeof(dest)), pixels, width, height))
+            snprintf(job->errors[i], sizeof(job->errors[i]), "Could not write '%.120s'.", dest);
+        pool_free(pixels);
+        trace_end("batch_image", span);
+    }
+    
+    return NULL;
 }
 
-// skips white space in file
-void skip_ws(FILE* json)
+// runs batch_worker on the calling thread and threads-1 helpers
+static int batch_run(BatchJob* job, int threads)
 {
-    int c = fgetc(json);
+    thread_t* pool = malloc(sizeof(thread_t)*job->count);
+    int started = 0;
+    
+    if (!pool)
+        return -1;
+    if (threads < 1)
+        threads = thread_count();
+    if (threads > job->count)
+        threads = job->count;
+    for (int i=1; i<threads; i++)
+        if (thread_create(&pool[started], batch_worker, job) == 0)
+            started++;
+    batch_worker(job);
+    for (int i=0; i<started; i++)
+        thread_join(pool[i]);
     
-    while(isspace(c))
-        c = fgetc(json);
+    free(pool);
+    return 0;
+}
+
+// decodes many files across all cores and prints their stats as a json array
+int batch_stats(const char** sources, int count, const char* filter, int threads)
+{
+    BatchJob job;
+    int failed = 0;
+    
+    job.sources = sources;
+    job.filter = filter;
+    job.count = count;
+    job.convert = 0;
+    job.next = 0;
+    job.stats = malloc(sizeof(ImageStats)*count);
+    job.errors = calloc(count, sizeof(*job.errors));
+    if (!job.stats || !job.errors || batch_run(&job, threads)) {
+        fprintf(stderr, "Error: Out of memory.");
+        return(1);
+    }
+    
+    printf("[");
+    for (int i=0; i<count; i++) {
+        if (job.errors[i][0]) {
+            fprintf(stderr, "Error: '%s': %s\n", sources[i], job.errors[i]);
+            failed++;
+            continue;
+        }
+        char* name = json_escape(sources[i]);
+        printf(i > failed ? ",\n{\"source\": \"%s\", \"stats\":\n" : "\n{\"source\": \"%s\", \"stats\":\n", name ? name : "");
+        stats_write_json(&job.stats[i], stdout);
+        free(name);
+        printf("}");
+    }
+    printf("\n]\n");
     
-    ungetc(c, json);
+    free(job.stats);
+    free(job.errors);
+    return(failed ? 1 : 0);
+}
+
+// converts every source to a .qoi file next to it, one file per worker at a time
+int batch_convert(const char** sources, int count, const char* filter, int threads)
+{
+    BatchJob job;
+    int failed = 0;
+    
+    job.sources = sources;
+    job.filter = filter;
+    job.count = count;
+    job.convert = 1;
+    job.next = 0;
+    job.stats = NULL;
+    job.errors = calloc(count, sizeof(*job.errors));
+    if (!job.errors || batch_run(&job, threads)) {
+        fprintf(stderr, "Error: Out of memory.");
+        return(1);
+    }
+    
+    for (int i=0; i<count; i++) {
+        if (job.errors[i][0]) {
+            fprintf(stderr, "Error: '%s': %s\n", sources[i], job.errors[i]);
+            failed++;
+        }
+    }
+    
+    free(job.errors);
+    return(failed ? 1 : 0);
 }
 
 static void error_callback(int error, const char* description)
@@ -296,18 +1193,45 @@ static void error_callback(int error, const char* description)
     fprintf(stderr, "Error: %s\n", description);
 }
 
+static void size_callback(GLFWwindow* window, int width, int height)
+{
+	replay_size(&replay, glfwGetTime(), width, height);
+}
+
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
 	float centerx, tempx;
 	float centery, tempy;
 	float angle = 0.0872665;
 	
+	replay_key(&replay, glfwGetTime(), key, scancode, action, mods);
+	
     if (action == GLFW_PRESS || action == GLFW_REPEAT) {
 		switch(key)
 		{
 			case GLFW_KEY_ESCAPE:
 				glfwSetWindowShouldClose(window, GLFW_TRUE);
 				break;
+			case GLFW_KEY_R: // reload the image from disk
+				if (action == GLFW_PRESS)
+					view_request = 'R';
+				break;
+			case GLFW_KEY_C: // decode only what is on screen
+				if (action == GLFW_PRESS)
+					view_request = 'C';
+				break;
+			case GLFW_KEY_F: // decode the whole image again
+				if (action == GLFW_PRESS)
+					view_request = 'F';
+				break;
+			case GLFW_KEY_H: // toggle histogram overlay
+				if (action == GLFW_PRESS)
+					show_histogram = !show_histogram;
+				break;
+			case GLFW_KEY_V: // next comparison view
+				if (action == GLFW_PRESS)
+					compare_view = (compare_view + 1) % 3;
+				break;
 			case GLFW_KEY_UP: // translate up
 				vertices[0].position[1] += 0.05;
 				vertices[1].position[1] += 0.05;
@@ -432,20 +1356,28 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
 	}
 }
 
-void glCompileShaderOrDie(GLuint shader)
+// writes the recorded spans to the -T path
+static void write_trace()
 {
-	GLint compiled;
-	glCompileShader(shader);
-	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	if (trace_write(trace_path))
+		fprintf(stderr, "Error: Could not write trace '%s'.\n", trace_path);
+}
+
+// packs the three histograms into a 256x1 texture scaled to the tallest bin
+void upload_histogram(const ImageStats* stats, GLuint tex)
+{
+	unsigned char bars[CHANNEL_SIZE+1][3];
+	unsigned long long tallest = 1;
 	
-	if (!compiled) {
-		GLint infoLen = 0;
-		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infoLen);
-		
-		char* info = malloc(infoLen+1);
-		GLint done;
-		glGetShaderInfoLog(shader, infoLen, &done, info);
-		printf("Unable to compile shader: %s\n", info);
-		exit(1);
-	}
+	for (int c=0; c<3; c++)
+		for (int v=0; v<=CHANNEL_SIZE; v++)
+			if (stats->hist[c][v] > tallest)
+				tallest = stats->hist[c][v];
+	
+	for (int c=0; c<3; c++)
+		for (int v=0; v<=CHANNEL_SIZE; v++)
+			bars[v][c] = (unsigned char) (stats->hist[c][v] * CHANNEL_SIZE / tallest);
+	
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, CHANNEL_SIZE+1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, bars);
 }
@@ -0,0 +1,19 @@
+/* 
+ * File:   ezview.h
+ * Author: Matthew
+ *
+ * Types shared between the viewer and its image processing modules.
+ */
+
+#ifndef EZVIEW_H
+#define EZVIEW_H
+
+#define CHANNEL_SIZE 255
+
+typedef struct {
+    unsigned char r;
+    unsigned char g;
+    unsigned char b;
+} Color;
+
+#endif
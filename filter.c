@@ -0,0 +1,356 @@
+/*
+ * File:   filter.c
+ * Author: Matthew
+ *
+ * Separable filters are run tile by tile: each worker converts the source rows
+ * a tile needs into planar floats, does the horizontal pass into a tile sized
+ * scratch buffer and then the vertical pass straight into the destination, so
+ * no full size temporary is ever allocated.
+ */
+
+#include "filter.h"
+#include "thread.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FILTER_SSE 1
+#endif
+
+// output columns per tile, a multiple of the SIMD width
+#define TILE_W 256
+// output rows per tile, keeps the scratch buffer around L2 size for small kernels
+#define TILE_H 64
+
+typedef struct {
+	const Filter* f;
+	const Color* src;
+	Color* dst;
+	int tiles_x;
+	int tiles;
+	int plane_len;
+	volatile long next;
+	volatile long failed;
+} FilterJob;
+
+static int clampi(int v, int lo, int hi)
+{
+	return v < lo ? lo : (v > hi ? hi : v);
+}
+
+// acc[i] += k * row[i]
+static void axpy(float* acc, const float* row, float k, int n)
+{
+	int i = 0;
+#ifdef FILTER_SSE
+	__m128 kk = _mm_set1_ps(k);
+	for (; i+4 <= n; i += 4)
+		_mm_storeu_ps(acc+i, _mm_add_ps(_mm_loadu_ps(acc+i), _mm_mul_ps(kk, _mm_loadu_ps(row+i))));
+#endif
+	for (; i<n; i++)
+		acc[i] += k * row[i];
+}
+
+static int axis_alloc(FilterAxis* a, int in_len, int out_len, int taps, int uniform)
+{
+	a->in_len = in_len;
+	a->out_len = out_len;
+	a->taps = taps;
+	a->uniform = uniform;
+	a->start = malloc(sizeof(int)*out_len);
+	a->weights = malloc(sizeof(float)*taps*(uniform ? 1 : out_len));
+
+	if (!a->start || !a->weights) {
+		free(a->start);
+		free(a->weights);
+		a->start = NULL;
+		a->weights = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+// normalized gaussian, 3 sigma on each side
+static int axis_gaussian(FilterAxis* a, int len, float sigma)
+{
+	int radius = (int) ceil(sigma * 3);
+	float sum = 0;
+
+	if (radius < 1)
+		radius = 1;
+	if (axis_alloc(a, len, len, radius*2+1, 1))
+		return -1;
+
+	for (int k=0; k<a->taps; k++) {
+		float d = (float) (k - radius);
+		a->weights[k] = (float) exp(-(d*d) / (2*sigma*sigma));
+		sum += a->weights[k];
+	}
+	for (int k=0; k<a->taps; k++)
+		a->weights[k] /= sum;
+	for (int x=0; x<len; x++)
+		a->start[x] = x - radius;
+
+	return 0;
+}
+
+// triangle filter, widened when shrinking so that every source sample contributes
+static int axis_resample(FilterAxis* a, int in_len, int out_len)
+{
+	double scale = (double) in_len / out_len;
+	double support = scale > 1 ? scale : 1;
+	int taps = (int) ceil(support*2) + 1;
+
+	if (axis_alloc(a, in_len, out_len, taps, 0))
+		return -1;
+
+	for (int x=0; x<out_len; x++) {
+		double center = (x + 0.5) * scale - 0.5;
+		int first = (int) floor(center - support) + 1;
+		float* w = a->weights + x*taps;
+		float sum = 0;
+
+		for (int k=0; k<taps; k++) {
+			double d = fabs((first + k - center) / support);
+			w[k] = d < 1 ? (float) (1 - d) : 0;
+			sum += w[k];
+		}
+		for (int k=0; k<taps; k++)
+			w[k] /= sum;
+		a->start[x] = first;
+	}
+
+	return 0;
+}
+
+int filter_blur(Filter* f, int w, int h, float sigma)
+{
+	memset(f, 0, sizeof(Filter));
+	if (sigma <= 0 || axis_gaussian(&f->x, w, sigma) || axis_gaussian(&f->y, h, sigma)) {
+		filter_free(f);
+		return -1;
+	}
+	return 0;
+}
+
+int filter_sharpen(Filter* f, int w, int h, float sigma, float amount)
+{
+	if (filter_blur(f, w, h, sigma))
+		return -1;
+	f->amount = amount;
+	return 0;
+}
+
+int filter_resize(Filter* f, int w, int h, int nw, int nh)
+{
+	memset(f, 0, sizeof(Filter));
+	if (nw < 1 || nh < 1 || axis_resample(&f->x, w, nw) || axis_resample(&f->y, h, nh)) {
+		filter_free(f);
+		return -1;
+	}
+	return 0;
+}
+
+// accepts 'blur:SIGMA', 'sharpen:SIGMA[:AMOUNT]' and 'resize:WxH'
+int filter_parse(Filter* f, const char* spec, int w, int h)
+{
+	float sigma, amount = 1;
+	int nw, nh;
+
+	if (sscanf(spec, "blur:%f", &sigma) == 1)
+		return filter_blur(f, w, h, sigma);
+	if (sscanf(spec, "sharpen:%f:%f", &sigma, &amount) >= 1)
+		return filter_sharpen(f, w, h, sigma, amount);
+	if (sscanf(spec, "resize:%dx%d", &nw, &nh) == 2)
+		return filter_resize(f, w, h, nw, nh);
+
+	return -1;
+}
+
+void filter_free(Filter* f)
+{
+	free(f->x.start);
+	free(f->x.weights);
+	free(f->y.start);
+	free(f->y.weights);
+	memset(f, 0, sizeof(Filter));
+}
+
+// horizontal pass for one source row: out[c][x] for destination columns x0..x0+n
+static void filter_row(const FilterAxis* a, const Color* row, float* plane, float* out, int x0, int n)
+{
+	int lo = a->start[x0];
+	int hi = a->start[x0+n-1] + a->taps;
+	int len = hi - lo;
+	float* pr = plane;
+	float* pg = plane + len;
+	float* pb = plane + len*2;
+
+	// unpack the packed 3 byte pixels into planar floats, replicating the edges
+	for (int i=0; i<len; i++) {
+		const Color* p = &row[clampi(lo + i, 0, a->in_len-1)];
+		pr[i] = p->r;
+		pg[i] = p->g;
+		pb[i] = p->b;
+	}
+
+	memset(out, 0, sizeof(float)*TILE_W*3);
+
+	if (a->uniform) {
+		for (int k=0; k<a->taps; k++) {
+			axpy(out, pr+k, a->weights[k], n);
+			axpy(out+TILE_W, pg+k, a->weights[k], n);
+			axpy(out+TILE_W*2, pb+k, a->weights[k], n);
+		}
+	} else {
+		for (int x=0; x<n; x++) {
+			const float* w = a->weights + (x0+x)*a->taps;
+			int s = a->start[x0+x] - lo;
+			float r = 0, g = 0, b = 0;
+
+			for (int k=0; k<a->taps; k++) {
+				r += w[k] * pr[s+k];
+				g += w[k] * pg[s+k];
+				b += w[k] * pb[s+k];
+			}
+			out[x] = r;
+			out[TILE_W+x] = g;
+			out[TILE_W*2+x] = b;
+		}
+	}
+}
+
+static unsigned char to_channel(float v)
+{
+	v += 0.5f;
+	return v <= 0 ? 0 : (v >= CHANNEL_SIZE ? CHANNEL_SIZE : (unsigned char) v);
+}
+
+static void* filter_worker(void* arg)
+{
+	FilterJob* job = arg;
+	const Filter* f = job->f;
+	int out_w = f->x.out_len;
+	int max_rows = 0;
+	float* mid = NULL;
+	float* plane = malloc(sizeof(float)*3*job->plane_len);
+	float* acc = malloc(sizeof(float)*TILE_W*3);
+	long long span = trace_begin();
+	long t;
+
+	if (!plane || !acc) {
+		atomic_store(&job->failed, 1);
+		goto done;
+	}
+
+	while ((t = atomic_add(&job->next, 1)) < job->tiles) {
+		int x0 = (int) (t % job->tiles_x) * TILE_W;
+		int y0 = (int) (t / job->tiles_x) * TILE_H;
+		int n = out_w - x0 < TILE_W ? out_w - x0 : TILE_W;
+		int m = f->y.out_len - y0 < TILE_H ? f->y.out_len - y0 : TILE_H;
+		int row0 = f->y.start[y0];
+		int rows = f->y.start[y0+m-1] + f->y.taps - row0;
+
+		// scratch holds the horizontally filtered rows this tile touches
+		if (rows > max_rows) {
+			float* tmp = realloc(mid, sizeof(float)*TILE_W*3*rows);
+			if (!tmp) {
+				atomic_store(&job->failed, 1);
+				break;
+			}
+			mid = tmp;
+			max_rows = rows;
+		}
+
+		for (int r=0; r<rows; r++) {
+			int sy = clampi(row0 + r, 0, f->y.in_len-1);
+			filter_row(&f->x, job->src + (size_t) sy*f->x.in_len, plane, mid + (size_t) r*TILE_W*3, x0, n);
+		}
+
+		for (int y=y0; y<y0+m; y++) {
+			const float* w = f->y.uniform ? f->y.weights : f->y.weights + y*f->y.taps;
+			int s = f->y.start[y] - row0;
+			Color* out = job->dst + (size_t) y*out_w + x0;
+
+			memset(acc, 0, sizeof(float)*TILE_W*3);
+			for (int k=0; k<f->y.taps; k++)
+				axpy(acc, mid + (size_t) (s+k)*TILE_W*3, w[k], TILE_W*3);
+
+			if (f->amount != 0) {
+				// unsharp mask, only built for same size filters
+				const Color* in = job->src + (size_t) y*out_w + x0;
+				for (int x=0; x<n; x++) {
+					out[x].r = to_channel(in[x].r + f->amount*(in[x].r - acc[x]));
+					out[x].g = to_channel(in[x].g + f->amount*(in[x].g - acc[TILE_W+x]));
+					out[x].b = to_channel(in[x].b + f->amount*(in[x].b - acc[TILE_W*2+x]));
+				}
+			} else {
+				for (int x=0; x<n; x++) {
+					out[x].r = to_channel(acc[x]);
+					out[x].g = to_channel(acc[TILE_W+x]);
+					out[x].b = to_channel(acc[TILE_W*2+x]);
+				}
+			}
+		}
+	}
+
+done:
+	free(mid);
+	free(plane);
+	free(acc);
+	trace_end("filter_tiles", span);
+	return NULL;
+}
+
+int filter_apply(const Filter* f, const Color* src, Color* dst, int threads)
+{
+	FilterJob job;
+	thread_t* pool;
+	int started = 0;
+
+	if (!f->x.start || !f->y.start || src == dst)
+		return -1;
+
+	job.f = f;
+	job.src = src;
+	job.dst = dst;
+	job.tiles_x = (f->x.out_len + TILE_W - 1) / TILE_W;
+	job.tiles = job.tiles_x * ((f->y.out_len + TILE_H - 1) / TILE_H);
+	job.plane_len = 0;
+	job.next = 0;
+	job.failed = 0;
+
+	// widest source span any column tile reads
+	for (int x0=0; x0<f->x.out_len; x0 += TILE_W) {
+		int x1 = x0 + TILE_W < f->x.out_len ? x0 + TILE_W : f->x.out_len;
+		int len = f->x.start[x1-1] + f->x.taps - f->x.start[x0];
+		if (len > job.plane_len)
+			job.plane_len = len;
+	}
+
+	if (threads < 1)
+		threads = thread_count();
+	if (threads > job.tiles)
+		threads = job.tiles;
+
+	// the calling thread works too, so only threads-1 helpers are started
+	long long span = trace_begin();
+	pool = malloc(sizeof(thread_t)*threads);
+	if (pool) {
+		for (int i=1; i<threads; i++)
+			if (thread_create(&pool[started], filter_worker, &job) == 0)
+				started++;
+	}
+	filter_worker(&job);
+	for (int i=0; i<started; i++)
+		thread_join(pool[i]);
+	free(pool);
+	trace_end("filter_apply", span);
+
+	return job.failed ? -1 : 0;
+}
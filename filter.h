@@ -0,0 +1,38 @@
+/* 
+ * File:   filter.h
+ * Author: Matthew
+ *
+ * CPU separable convolution / resampling on Color buffers.
+ */
+
+#ifndef FILTER_H
+#define FILTER_H
+
+#include "ezview.h"
+
+// weights for one axis of a separable filter
+typedef struct {
+	int in_len;     // source samples along this axis
+	int out_len;    // destination samples along this axis
+	int taps;       // weights per destination sample
+	int uniform;    // every sample uses the same weights, starting at x - taps/2
+	int* start;     // first source sample per destination sample, may be out of range
+	float* weights; // out_len*taps weights, or just taps when uniform
+} FilterAxis;
+
+typedef struct {
+	FilterAxis x;
+	FilterAxis y;
+	float amount;   // 0 for a plain filter, otherwise unsharp mask strength
+} Filter;
+
+int filter_blur(Filter* f, int w, int h, float sigma);
+int filter_sharpen(Filter* f, int w, int h, float sigma, float amount);
+int filter_resize(Filter* f, int w, int h, int nw, int nh);
+int filter_parse(Filter* f, const char* spec, int w, int h);
+void filter_free(Filter* f);
+
+// runs both passes over src (f->x.in_len by f->y.in_len) into dst (out_len by out_len)
+int filter_apply(const Filter* f, const Color* src, Color* dst, int threads);
+
+#endif
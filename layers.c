@@ -0,0 +1,337 @@
+/*
+ * File:   layers.c
+ * Author: Matthew
+ *
+ * GLES 2 has no instancing, so every layer gets its own six vertices in one
+ * static buffer, tagged with its slot in the batch. The vertex shader looks
+ * its transform up in a uniform array by that slot and the fragment shader
+ * picks the sampler with it, which leaves one uniform upload and one draw
+ * call per batch, and a batch holds as many layers as there are texture
+ * units.
+ */
+
+#include "layers.h"
+#include "ppm.h"
+#include "pool.h"
+#include "progcache.h"
+#include "thread.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SHADER_SIZE 4096
+
+typedef struct {
+	LayerStack* s;
+	Color** pixels;
+	char (*errors)[128];
+	volatile long next;
+} LayerJob;
+
+// 1 if text is exactly six comma separated numbers
+static int parse_transform(const char* text, float m[6])
+{
+	int n = 0;
+
+	return sscanf(text, "%f,%f,%f,%f,%f,%f%n", m, m+1, m+2, m+3, m+4, m+5, &n) == 6 && !text[n];
+}
+
+int layers_parse(LayerStack* s, const char* spec)
+{
+	Layer* l = &s->layers[s->count];
+	char* colon;
+	float opacity;
+	int n = 0;
+
+	if (s->count == LAYER_MAX)
+		return -1;
+	memset(l, 0, sizeof(Layer));
+	l->transform[0] = l->transform[3] = 1;
+	l->opacity = 1;
+	l->path = malloc(strlen(spec) + 1);
+	if (!l->path)
+		return -1;
+	strcpy(l->path, spec);
+
+	// options are taken off the end, so a colon can still be part of the path
+	colon = strrchr(l->path, ':');
+	if (colon && parse_transform(colon + 1, l->transform)) {
+		*colon = '\0';
+		colon = strrchr(l->path, ':');
+	}
+	if (colon && sscanf(colon + 1, "%f%n", &opacity, &n) == 1 && !colon[1 + n]) {
+		if (opacity < 0 || opacity > 1) {
+			free(l->path);
+			return -1;
+		}
+		l->opacity = opacity;
+		*colon = '\0';
+	}
+	if (!l->path[0]) {
+		free(l->path);
+		return -1;
+	}
+
+	s->count++;
+	return 0;
+}
+
+static void* layer_worker(void* arg)
+{
+	LayerJob* job = arg;
+	long i;
+
+	while ((i = atomic_add(&job->next, 1)) < job->s->count) {
+		long long span = trace_begin();
+		PpmDecoder decoder;
+		Layer* l = &job->s->layers[i];
+
+		job->pixels[i] = ppm_load(&decoder, l->path);
+		if (job->pixels[i]) {
+			l->w = decoder.w;
+			l->h = decoder.h;
+		} else {
+			snprintf(job->errors[i], sizeof(job->errors[i]), "%s", decoder.error);
+		}
+		trace_end("layer_decode", span);
+	}
+
+	return NULL;
+}
+
+// helpers are named, the calling thread keeps its own name
+static void* layer_thread(void* arg)
+{
+	trace_thread_name("layers");
+	return layer_worker(arg);
+}
+
+// one sampler per slot; sampler arrays can only be indexed by constants in
+// GLES 2 fragment shaders, so the slot is found by comparison
+static void shader_text(int batch, char* vs, char* fs)
+{
+	int n;
+
+	snprintf(vs, SHADER_SIZE,
+		"attribute vec3 Corner;\n"
+		"uniform vec4 Transforms[%d];\n"
+		"varying mediump vec2 TexCoordOut;\n"
+		"varying mediump float Slot;\n"
+		"varying lowp float Opacity;\n"
+		"void main()\n"
+		"{\n"
+		"    int i = int(Corner.z) * 2;\n"
+		"    vec4 m = Transforms[i];\n"
+		"    vec4 t = Transforms[i + 1];\n"
+		"    gl_Position = vec4(m.xy * Corner.x + m.zw * Corner.y + t.xy, 0.0, 1.0);\n"
+		"    TexCoordOut = Corner.xy;\n"
+		"    Slot = Corner.z;\n"
+		"    Opacity = t.z;\n"
+		"}\n", batch * 2);
+
+	n = snprintf(fs, SHADER_SIZE,
+		"varying mediump vec2 TexCoordOut;\n"
+		"varying mediump float Slot;\n"
+		"varying lowp float Opacity;\n"
+		"uniform sampler2D Textures[%d];\n"
+		"void main()\n"
+		"{\n"
+		"    lowp vec3 c = texture2D(Textures[0], TexCoordOut).rgb;\n", batch);
+	for (int i=1; i<batch; i++)
+		n += snprintf(fs + n, SHADER_SIZE - n,
+			"    %sif (Slot > %d.5) c = texture2D(Textures[%d], TexCoordOut).rgb;\n", i > 1 ? "else " : "", batch - 1 - i, batch - i);
+	snprintf(fs + n, SHADER_SIZE - n,
+		"    gl_FragColor = vec4(c, Opacity);\n"
+		"}\n");
+}
+
+int layers_init(LayerStack* s, UploadFormat format, int threads)
+{
+	LayerJob job;
+	thread_t pool[LAYER_MAX];
+	Color* pixels[LAYER_MAX];
+	char errors[LAYER_MAX][128];
+	GLfloat* corners;
+	GLint units, vectors;
+	int started = 0;
+	GLint samplers[LAYER_MAX];
+	char vs[SHADER_SIZE], fs[SHADER_SIZE];
+	int failed = -1;
+
+	s->error[0] = '\0';
+	if (!s->count)
+		return 0;
+
+	// every layer is decoded before anything is uploaded
+	long long span = trace_begin();
+	memset(errors, 0, sizeof(errors));
+	job.s = s;
+	job.pixels = pixels;
+	job.errors = errors;
+	job.next = 0;
+	if (threads < 1)
+		threads = thread_count();
+	if (threads > s->count)
+		threads = s->count;
+	for (int i=1; i<threads; i++)
+		if (thread_create(&pool[started], layer_thread, &job) == 0)
+			started++;
+	layer_worker(&job);
+	for (int i=0; i<started; i++)
+		thread_join(pool[i]);
+	trace_end("layers_decode", span);
+
+	span = trace_begin();
+	for (int i=0; i<s->count; i++) {
+		Layer* l = &s->layers[i];
+
+		if (!pixels[i]) {
+			if (failed < 0)
+				snprintf(s->error, sizeof(s->error), "'%.100s': %s", l->path, errors[i]);
+			failed = i;
+			continue;
+		}
+		glGenTextures(1, &l->texture);
+		glBindTexture(GL_TEXTURE_2D, l->texture);
+		// layers are usually scaled, so they're filtered unlike the image
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		if (upload_texture(format, pixels[i], l->w, l->h) && failed < 0) {
+			snprintf(s->error, sizeof(s->error), "'%.100s': Could not upload the layer.", l->path);
+			failed = i;
+		}
+		pool_free(pixels[i]);
+	}
+	trace_end("layers_upload", span);
+	if (failed >= 0)
+		return -1;
+
+	// a batch needs a texture unit and two uniform vectors per layer
+	glGetIntegerv(GL_MAX_TEXTURE_IMAGE_UNITS, &units);
+	glGetIntegerv(GL_MAX_VERTEX_UNIFORM_VECTORS, &vectors);
+	s->batch = s->count;
+	if (s->batch > units)
+		s->batch = units;
+	if (s->batch > (vectors - 8) / 2)
+		s->batch = (vectors - 8) / 2;
+	if (s->batch < 1) {
+		snprintf(s->error, sizeof(s->error), "The driver has no texture units for layers.");
+		return -1;
+	}
+
+	shader_text(s->batch, vs, fs);
+	s->program = build_program(vs, fs);
+	s->corner_location = glGetAttribLocation(s->program, "Corner");
+	s->transform_location = glGetUniformLocation(s->program, "Transforms");
+	if (s->corner_location == -1 || s->transform_location == -1) {
+		snprintf(s->error, sizeof(s->error), "Could not build the layer shader.");
+		return -1;
+	}
+	for (int i=0; i<s->batch; i++)
+		samplers[i] = i;
+	glUseProgram(s->program);
+	glUniform1iv(glGetUniformLocation(s->program, "Textures"), s->batch, samplers);
+	glEnableVertexAttribArray(s->corner_location);
+
+	// the first batch stays on units 1 and up, which nothing else uses, so a
+	// single batch only rebinds unit 0 when it's drawn
+	for (int i=1; i<s->batch; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(GL_TEXTURE_2D, s->layers[i].texture);
+		s->bound[i] = s->layers[i].texture;
+	}
+	glActiveTexture(GL_TEXTURE0);
+
+	// two triangles per layer in the unit square, y down like the image rows
+	static const GLfloat square[6][2] = {{0, 0}, {1, 0}, {1, 1}, {1, 1}, {0, 1}, {0, 0}};
+	corners = malloc(sizeof(GLfloat) * 3 * 6 * s->count);
+	if (!corners) {
+		snprintf(s->error, sizeof(s->error), "Out of memory.");
+		return -1;
+	}
+	for (int i=0; i<s->count; i++) {
+		for (int v=0; v<6; v++) {
+			GLfloat* c = corners + (i*6 + v) * 3;
+			c[0] = square[v][0];
+			c[1] = square[v][1];
+			c[2] = (GLfloat) (i % s->batch);
+		}
+	}
+	glGenBuffers(1, &s->buffer);
+	glBindBuffer(GL_ARRAY_BUFFER, s->buffer);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(GLfloat) * 3 * 6 * s->count, corners, GL_STATIC_DRAW);
+	free(corners);
+	return 0;
+}
+
+void layers_draw(LayerStack* s, const float base[6])
+{
+	int active = 0;
+
+	if (!s->count || !s->program)
+		return;
+
+	glUseProgram(s->program);
+	glBindBuffer(GL_ARRAY_BUFFER, s->buffer);
+	glVertexAttribPointer(s->corner_location, 3, GL_FLOAT, GL_FALSE, sizeof(GLfloat) * 3, (void*) 0);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+
+	// primitives blend in order within a draw, so each batch goes back to front
+	for (int first=0; first<s->count; first+=s->batch) {
+		int n = s->count - first < s->batch ? s->count - first : s->batch;
+
+		for (int i=0; i<n; i++) {
+			const Layer* l = &s->layers[first + i];
+			const float* q = l->transform;
+			GLfloat* t = s->transforms + i*8;
+			// base after the layer transform, after scaling the unit square to the layer
+			float a = (base[0]*q[0] + base[1]*q[2]) * l->w;
+			float b = (base[0]*q[1] + base[1]*q[3]) * l->h;
+			float c = (base[2]*q[0] + base[3]*q[2]) * l->w;
+			float d = (base[2]*q[1] + base[3]*q[3]) * l->h;
+
+			t[0] = a;
+			t[1] = c;
+			t[2] = b;
+			t[3] = d;
+			t[4] = base[0]*q[4] + base[1]*q[5] + base[4];
+			t[5] = base[2]*q[4] + base[3]*q[5] + base[5];
+			t[6] = l->opacity;
+			t[7] = 0;
+
+			// the image is drawn from unit 0 in between, the other units keep
+			// the layer they had last
+			if (i == 0 || s->bound[i] != l->texture) {
+				if (active != i) {
+					glActiveTexture(GL_TEXTURE0 + i);
+					active = i;
+				}
+				glBindTexture(GL_TEXTURE_2D, l->texture);
+				s->bound[i] = l->texture;
+			}
+		}
+		glUniform4fv(s->transform_location, n * 2, s->transforms);
+		glDrawArrays(GL_TRIANGLES, first * 6, n * 6);
+	}
+
+	glDisable(GL_BLEND);
+	if (active)
+		glActiveTexture(GL_TEXTURE0);
+}
+
+void layers_destroy(LayerStack* s)
+{
+	for (int i=0; i<s->count; i++) {
+		if (s->layers[i].texture)
+			glDeleteTextures(1, &s->layers[i].texture);
+		free(s->layers[i].path);
+	}
+	if (s->buffer)
+		glDeleteBuffers(1, &s->buffer);
+	memset(s, 0, sizeof(LayerStack));
+}
@@ -0,0 +1,52 @@
+/*
+ * File:   layers.h
+ * Author: Matthew
+ *
+ * Images composited over the viewed one, each with its own affine transform
+ * and opacity, drawn back to front in as few draw calls as the texture units
+ * allow.
+ */
+
+#ifndef LAYERS_H
+#define LAYERS_H
+
+#include <GLES2/gl2.h>
+
+#include "ezview.h"
+#include "upload.h"
+
+#define LAYER_MAX 16
+
+typedef struct {
+	char* path;
+	float transform[6];     // layer pixel x, y to file pixel a*x + b*y + e, c*x + d*y + f
+	float opacity;
+	int w;
+	int h;
+	GLuint texture;
+} Layer;
+
+typedef struct {
+	Layer layers[LAYER_MAX];    // back to front
+	int count;
+	int batch;                  // layers per draw call, one texture unit each
+	GLuint program;
+	GLuint buffer;
+	GLint corner_location;
+	GLint transform_location;
+	GLfloat transforms[LAYER_MAX * 8];  // two vec4 per layer of a batch
+	GLuint bound[LAYER_MAX];    // texture on each unit, unit 0 is shared with the image
+	char error[160];
+} LayerStack;
+
+// adds 'PATH[:OPACITY[:A,B,C,D,E,F]]', identity and fully opaque by default
+int layers_parse(LayerStack* s, const char* spec);
+// decodes every layer on up to threads threads and uploads them, needs the
+// GL context; the failing layer is named in s->error
+int layers_init(LayerStack* s, UploadFormat format, int threads);
+// base maps file pixels to clip space: x' = a*x + b*y + e, y' = c*x + d*y + f;
+// expects texture unit 0 active and leaves it active
+void layers_draw(LayerStack* s, const float base[6]);
+void layers_destroy(LayerStack* s);
+
+#endif
@@ -0,0 +1,132 @@
+#!/bin/sh
+#
+# Training run for 'make pgo'. Decodes P3, P6, QOI, gzip and zstd versions
+# of input.ppm at several sizes, filters, crops, compares and converts them,
+# then replays a scripted session of transforms in a hidden window.
+#
+# usage: pgo-workload.sh EZVIEW [WORKDIR]
+#
+# PGO_CODECS lists the compressed formats EZVIEW was built with, gzip and
+# zstd when unset. Any failure fails the run, including the window session
+# when there's no display; PGO_NO_DISPLAY=1 leaves that session out instead.
+
+set -e
+
+ezview=$1
+work=${2:-pgo-work}
+src=$(dirname "$0")/input.ppm
+codecs=${PGO_CODECS-gzip zstd}
+
+if [ ! -x "$ezview" ]; then
+	echo "usage: pgo-workload.sh EZVIEW [WORKDIR]" >&2
+	exit 1
+fi
+rm -rf "$work"
+mkdir -p "$work"
+
+# ezview writes a three line P6 header, the samples after it become P3 text
+to_p3() {
+	skip=$(head -n 3 "$1" | wc -c)
+	{
+		head -n 3 "$1" | sed '1s/P6/P3/'
+		tail -c +$((skip + 1)) "$1" | od -An -v -tu1
+	} > "$2"
+}
+
+# built into ezview and its command line tool installed
+has_codec() {
+	case " $codecs " in
+	*" $1 "*) command -v "$1" > /dev/null ;;
+	*) return 1 ;;
+	esac
+}
+
+varint() {
+	v=$1
+	while [ "$v" -ge 128 ]; do
+		printf "\\$(printf '%03o' $(((v & 127) | 128)))"
+		v=$((v >> 7))
+	done
+	printf "\\$(printf '%03o' "$v")"
+}
+
+# key press FRAMES after the previous event: frame and time deltas, type,
+# key and scancode zigzag coded, then action and mods (see replay.c)
+press() {
+	varint "$2"; varint 0; varint 1; varint $(($1 * 2)); varint 0; varint 1
+}
+
+for size in 64x64 640x480 1920x1080 2560x1440; do
+	p6=$work/p6_$size.ppm
+	p3=$work/p3_$size.ppm
+	"$ezview" -f resize:$size -o "$p6" "$src"
+	to_p3 "$p6" "$p3"
+
+	for image in "$p6" "$p3"; do
+		"$ezview" -j "$image" > /dev/null
+		"$ezview" -c 16,16,32,32 -o "$work/crop.ppm" "$image"
+		"$ezview" -f blur:1.5 -o "$work/blur.ppm" "$image"
+		"$ezview" -f sharpen:1:0.5 -o "$work/sharp.qoi" "$image"
+	done
+	"$ezview" -d -j "$p6" "$p3" > /dev/null
+	"$ezview" -d -j "$p6" "$work/blur.ppm" > /dev/null
+	if has_codec gzip; then
+		gzip -c "$p6" > "$p6.gz"
+		"$ezview" -j "$p6.gz" > /dev/null
+	fi
+	if has_codec zstd; then
+		zstd -q -c "$p6" > "$p6.zst"
+		"$ezview" -j "$p6.zst" > /dev/null
+	fi
+done
+
+"$ezview" -q "$work"/p6_*.ppm
+"$ezview" -j "$work"/p6_*.qoi > /dev/null
+
+# QOI must round trip exactly; colors that repeat every 8 pixels, with
+# black in between, go through the color index, and the right edge is a run
+awk 'BEGIN {
+	print "P3\n64 64\n255"
+	for (y = 0; y < 64; y++)
+		for (x = 0; x < 64; x++)
+			if ((x + y) % 4 == 3 || x > 56)
+				print "0 0 0"
+			else
+				print 20 + x % 8 * 30, 20 + y % 8 * 30, 20 + (x + y) % 8 * 30
+}' > "$work/pattern.ppm"
+for image in "$work/pattern.ppm" "$work"/p6_*.ppm; do
+	"$ezview" -o "$work/round.ppm" "$image"
+	"$ezview" -o "$work/round.qoi" "$work/round.ppm"
+	"$ezview" -o "$work/back.ppm" "$work/round.qoi"
+	if ! cmp -s "$work/round.ppm" "$work/back.ppm"; then
+		echo "pgo-workload.sh: '$image' doesn't survive a QOI round trip." >&2
+		exit 1
+	fi
+done
+
+# pan, zoom, shear and rotate around the image every other frame
+{
+	printf 'EZVR\001'
+	round=0
+	while [ $round -lt 20 ]; do
+		# X E right up W D Q Z left down S A
+		for key in 88 69 262 265 87 68 81 90 263 264 83 65; do
+			press $key 2
+		done
+		round=$((round + 1))
+	done
+	varint 30; varint 0; varint 0
+} > "$work/session.ezvr"
+
+if [ -n "$PGO_NO_DISPLAY" ]; then
+	echo "pgo-workload.sh: PGO_NO_DISPLAY is set, the frame loop isn't trained." >&2
+	exit 0
+fi
+run="$ezview"
+if [ -z "$DISPLAY" ] && [ -z "$WAYLAND_DISPLAY" ] && command -v xvfb-run > /dev/null; then
+	run="xvfb-run -a $ezview"
+fi
+if ! $run -H -p "$work/session.ezvr" "$work/p6_1920x1080.ppm" > /dev/null; then
+	echo "pgo-workload.sh: the window session failed, set PGO_NO_DISPLAY=1 to train without it." >&2
+	exit 1
+fi
@@ -0,0 +1,247 @@
+/*
+ * File:   pool.c
+ * Author: Matthew
+ *
+ * Sizes are rounded up to one of four classes per power of two, so a buffer
+ * freed by one image fits the next image of a similar size. Each buffer is
+ * its own mapping with a one cache line header in front that records the
+ * class, which keeps the returned pointer 64 byte aligned.
+ */
+
+#include "pool.h"
+#include "thread.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#endif
+
+#define MIN_SHIFT 16
+#define CLASSES ((int) (sizeof(size_t)*8 - MIN_SHIFT) * 4)
+#define HUGE_PAGE ((size_t) 2 << 20)
+
+typedef struct PoolBlock {
+	struct PoolBlock* next;
+	size_t mapped;
+	int cls;
+	int huge;
+} PoolBlock;
+
+static struct {
+	int init;
+	int flags;
+	size_t cache_limit;
+	mutex_t lock;
+	PoolBlock* free[CLASSES];
+	PoolStats stats;
+} pool;
+
+// class index and size for a request that includes the header
+static int size_class(size_t n, size_t* size)
+{
+	int shift = MIN_SHIFT;
+
+	while (shift < (int) sizeof(size_t)*8 - 1 && ((size_t) 1 << (shift+1)) < n)
+		shift++;
+
+	// 1, 1.25, 1.5, 1.75 and 2 times 2^shift
+	for (int q=0; q<=4; q++) {
+		size_t s = ((size_t) 1 << shift) + (((size_t) 1 << shift) >> 2) * q;
+		if (s >= n) {
+			*size = s;
+			return q == 4 ? (shift - MIN_SHIFT + 1) * 4 : (shift - MIN_SHIFT) * 4 + q;
+		}
+	}
+
+	return -1;
+}
+
+static PoolBlock* block_map(size_t size, int cls)
+{
+	PoolBlock* b;
+	int huge = 0;
+
+#ifdef _WIN32
+	b = _aligned_malloc(size, POOL_ALIGN);
+	if (!b)
+		return NULL;
+#else
+	b = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	// explicit huge pages need a reserved hugetlbfs pool, so failing is normal
+	if ((pool.flags & POOL_HUGE) && size % HUGE_PAGE == 0) {
+		b = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		huge = b != MAP_FAILED;
+	}
+#endif
+	if (b == MAP_FAILED) {
+		b = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (b == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		// otherwise ask for transparent huge pages
+		if ((pool.flags & POOL_HUGE) && size >= HUGE_PAGE)
+			madvise(b, size, MADV_HUGEPAGE);
+#endif
+	}
+#endif
+
+	b->next = NULL;
+	b->mapped = size;
+	b->cls = cls;
+	b->huge = huge;
+	return b;
+}
+
+static void block_unmap(PoolBlock* b)
+{
+#ifdef _WIN32
+	_aligned_free(b);
+#else
+	munmap(b, b->mapped);
+#endif
+}
+
+static void pool_peak()
+{
+	unsigned long long total = pool.stats.bytes_in_use + pool.stats.bytes_cached;
+	if (total > pool.stats.peak_bytes)
+		pool.stats.peak_bytes = total;
+}
+
+void pool_init(int flags, size_t cache_limit)
+{
+	if (!pool.init) {
+		mutex_init(&pool.lock);
+		pool.init = 1;
+	}
+	pool.flags = flags;
+	pool.cache_limit = cache_limit;
+}
+
+void* pool_alloc(size_t size)
+{
+	PoolBlock* b;
+	size_t class_bytes;
+	int cls = size_class(size + POOL_ALIGN, &class_bytes);
+
+	if (cls < 0)
+		return NULL;
+	if (!pool.init)
+		pool_init(POOL_HUGE, (size_t) 1 << 30);
+
+	mutex_lock(&pool.lock);
+	pool.stats.allocs++;
+	b = pool.free[cls];
+	if (b) {
+		pool.free[cls] = b->next;
+		pool.stats.reuses++;
+		pool.stats.bytes_cached -= b->mapped;
+		pool.stats.bytes_in_use += b->mapped;
+		mutex_unlock(&pool.lock);
+		return (char*) b + POOL_ALIGN;
+	}
+	mutex_unlock(&pool.lock);
+
+	b = block_map(class_bytes, cls);
+	if (!b)
+		return NULL;
+
+	mutex_lock(&pool.lock);
+	pool.stats.maps++;
+	pool.stats.huge_maps += b->huge;
+	pool.stats.bytes_in_use += b->mapped;
+	pool_peak();
+	mutex_unlock(&pool.lock);
+
+	return (char*) b + POOL_ALIGN;
+}
+
+void pool_free(void* p)
+{
+	PoolBlock* b;
+
+	if (!p)
+		return;
+	b = (PoolBlock*) ((char*) p - POOL_ALIGN);
+
+	mutex_lock(&pool.lock);
+	pool.stats.bytes_in_use -= b->mapped;
+	if (pool.stats.bytes_cached + b->mapped <= pool.cache_limit) {
+		b->next = pool.free[b->cls];
+		pool.free[b->cls] = b;
+		pool.stats.bytes_cached += b->mapped;
+		b = NULL;
+	} else {
+		pool.stats.unmaps++;
+	}
+	mutex_unlock(&pool.lock);
+
+	if (b)
+		block_unmap(b);
+}
+
+int pool_reserve(size_t size, int count)
+{
+	void** held;
+	int n = 0;
+
+	if (count < 1)
+		return 0;
+	held = malloc(sizeof(void*) * count);
+	if (!held)
+		return -1;
+
+	// hold them all at once so each one is a separate buffer
+	while (n < count && (held[n] = pool_alloc(size)) != NULL) {
+		memset(held[n], 0, size);
+		n++;
+	}
+	for (int i=0; i<n; i++)
+		pool_free(held[i]);
+
+	free(held);
+	return n == count ? 0 : -1;
+}
+
+void pool_trim()
+{
+	if (!pool.init)
+		return;
+
+	mutex_lock(&pool.lock);
+	for (int c=0; c<CLASSES; c++) {
+		while (pool.free[c]) {
+			PoolBlock* b = pool.free[c];
+			pool.free[c] = b->next;
+			pool.stats.bytes_cached -= b->mapped;
+			pool.stats.unmaps++;
+			block_unmap(b);
+		}
+	}
+	mutex_unlock(&pool.lock);
+}
+
+void pool_stats(PoolStats* stats)
+{
+	if (!pool.init) {
+		memset(stats, 0, sizeof(PoolStats));
+		return;
+	}
+	mutex_lock(&pool.lock);
+	*stats = pool.stats;
+	mutex_unlock(&pool.lock);
+}
+
+void pool_write_json(FILE* fp)
+{
+	PoolStats s;
+	pool_stats(&s);
+	fprintf(fp, "{\"allocs\": %llu, \"reuses\": %llu, \"maps\": %llu, \"unmaps\": %llu, \"huge_maps\": %llu, "
+		"\"bytes_in_use\": %llu, \"bytes_cached\": %llu, \"peak_bytes\": %llu}\n",
+		s.allocs, s.reuses, s.maps, s.unmaps, s.huge_maps, s.bytes_in_use, s.bytes_cached, s.peak_bytes);
+}
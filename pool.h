@@ -0,0 +1,39 @@
+/* 
+ * File:   pool.h
+ * Author: Matthew
+ *
+ * Size classed, 64 byte aligned image buffers that are kept and reused after
+ * they are freed instead of going back to the system.
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define POOL_ALIGN 64
+// back buffers with huge pages when the system has them
+#define POOL_HUGE 1
+
+typedef struct {
+	unsigned long long allocs;       // pool_alloc calls
+	unsigned long long reuses;       // of those, served from a free list
+	unsigned long long maps;         // buffers taken from the system
+	unsigned long long unmaps;       // buffers given back
+	unsigned long long huge_maps;    // maps that got explicit huge pages
+	unsigned long long bytes_in_use;
+	unsigned long long bytes_cached;
+	unsigned long long peak_bytes;   // largest bytes_in_use + bytes_cached seen
+} PoolStats;
+
+void pool_init(int flags, size_t cache_limit);
+void* pool_alloc(size_t size);
+void pool_free(void* p);
+// maps and touches count buffers of size now so later loads don't page fault
+int pool_reserve(size_t size, int count);
+void pool_trim();
+void pool_stats(PoolStats* stats);
+void pool_write_json(FILE* fp);
+
+#endif
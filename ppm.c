@@ -0,0 +1,686 @@
+/*
+ * File:   ppm.c
+ * Author: Matthew
+ *
+ * Every source is read through one buffer, so the header and pixel parsers
+ * don't care whether the bytes come from a file, a descriptor, memory or a
+ * callback.
+ */
+
+#include "ppm.h"
+#include "pool.h"
+#include "qoi.h"
+#include "trace.h"
+#include "zsource.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <ctype.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#ifdef _WIN32
+#define seek_file _fseeki64
+#define off_type long long
+#else
+#define seek_file fseeko
+#define off_type off_t
+#endif
+
+static int ppm_fail(PpmDecoder* d, const char* fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(d->error, sizeof(d->error), fmt, args);
+	va_end(args);
+	return -1;
+}
+
+static size_t read_file(void* user, void* buf, size_t len)
+{
+	return fread(buf, 1, len, (FILE*) user);
+}
+
+static size_t read_fd(void* user, void* buf, size_t len)
+{
+	int fd = *(int*) user;
+#ifdef _WIN32
+	long n = _read(fd, buf, (unsigned int) len);
+#else
+	long n = (long) read(fd, buf, len);
+#endif
+	return n > 0 ? (size_t) n : 0;
+}
+
+static int ppm_init(PpmDecoder* d)
+{
+	memset(d, 0, sizeof(PpmDecoder));
+	d->fd = -1;
+	d->store = malloc(PPM_BUFSIZE);
+	d->buf = d->store;
+	return d->store ? 0 : ppm_fail(d, "Out of memory.");
+}
+
+int ppm_open_path(PpmDecoder* d, const char* path)
+{
+	unsigned char magic[4];
+	int kind;
+
+	if (ppm_init(d))
+		return -1;
+	d->fp = fopen(path, "rb");
+	if (!d->fp)
+		return ppm_fail(d, "File not found.");
+	d->owns = 1;
+	d->read = read_file;
+	d->user = d->fp;
+
+	// the first bytes stay in the buffer unless the file turns out compressed
+	d->len = fread(magic, 1, sizeof(magic), d->fp);
+	d->bytes_read = d->len;
+	memcpy(d->store, magic, d->len);
+	kind = zsource_detect(magic, d->len);
+	if (kind == ZSOURCE_NONE)
+		return 0;
+
+	// compressed files are decompressed on their own thread and read as a stream
+	if (seek_file(d->fp, 0, SEEK_SET))
+		return ppm_fail(d, "Source is not seekable.");
+	d->user = zsource_open(d->fp, kind, d->error, sizeof(d->error));
+	if (!d->user)
+		return -1;
+	d->fp = NULL;
+	d->owns = 0;
+	d->read = zsource_read;
+	d->release = zsource_close;
+	d->status = zsource_status;
+	d->len = 0;
+	d->bytes_read = 0;
+	return 0;
+}
+
+int ppm_open_fd(PpmDecoder* d, int fd)
+{
+	if (ppm_init(d))
+		return -1;
+	d->fd = fd;
+	d->read = read_fd;
+	d->user = &d->fd;
+	return 0;
+}
+
+int ppm_open_memory(PpmDecoder* d, const void* data, size_t len)
+{
+	memset(d, 0, sizeof(PpmDecoder));
+	d->fd = -1;
+	d->buf = data;
+	d->len = len;
+	d->eof = 1;
+	d->memory = 1;
+	d->bytes_read = len;
+	return 0;
+}
+
+int ppm_open_stream(PpmDecoder* d, ppm_read_fn read, void* user)
+{
+	if (ppm_init(d))
+		return -1;
+	d->read = read;
+	d->user = user;
+	return 0;
+}
+
+// refills the buffer, returns bytes available
+static size_t ppm_fill(PpmDecoder* d)
+{
+	if (d->pos < d->len)
+		return d->len - d->pos;
+	if (d->eof)
+		return 0;
+
+	d->offset += d->len;
+	d->pos = 0;
+	d->len = d->read(d->user, d->store, PPM_BUFSIZE);
+	d->bytes_read += d->len;
+	if (d->len == 0)
+		d->eof = 1;
+	return d->len;
+}
+
+// makes sure at least n bytes are buffered unless the source ends first,
+// returns bytes available
+static size_t ppm_ensure(PpmDecoder* d, size_t n)
+{
+	size_t avail = d->len - d->pos;
+
+	if (avail >= n || d->eof || d->memory)
+		return avail;
+
+	// keep the unread tail and top the buffer up behind it
+	memmove(d->store, d->buf + d->pos, avail);
+	d->offset += d->pos;
+	d->pos = 0;
+	d->len = avail;
+	while (d->len < n) {
+		size_t got = d->read(d->user, d->store + d->len, PPM_BUFSIZE - d->len);
+		if (got == 0) {
+			d->eof = 1;
+			break;
+		}
+		d->len += got;
+		d->bytes_read += got;
+	}
+	return d->len;
+}
+
+int ppm_seekable(const PpmDecoder* d)
+{
+	return d->memory || d->fp || d->fd >= 0;
+}
+
+// moves the buffered reader to offset in the source
+static int ppm_seek(PpmDecoder* d, long long offset)
+{
+	if (d->memory) {
+		if (offset > (long long) d->len)
+			return ppm_fail(d, "Unexpected end of file.");
+		d->pos = (size_t) offset;
+		return 0;
+	}
+
+	if (d->fp) {
+		if (seek_file(d->fp, (off_type) offset, SEEK_SET))
+			return ppm_fail(d, "Source is not seekable.");
+	} else if (d->fd >= 0) {
+#ifdef _WIN32
+		if (_lseeki64(d->fd, offset, SEEK_SET) < 0)
+#else
+		if (lseek(d->fd, (off_t) offset, SEEK_SET) < 0)
+#endif
+			return ppm_fail(d, "Source is not seekable.");
+	} else {
+		return ppm_fail(d, "Source is not seekable.");
+	}
+
+	d->offset = offset;
+	d->pos = 0;
+	d->len = 0;
+	d->eof = 0;
+	return 0;
+}
+
+// reads len bytes at offset without disturbing the buffered reader
+static int ppm_pread(PpmDecoder* d, long long offset, void* dst, size_t len)
+{
+	if (d->memory) {
+		if (offset + (long long) len > (long long) d->len)
+			return ppm_fail(d, "Unexpected end of file.");
+		memcpy(dst, d->buf + offset, len);
+		return 0;
+	}
+
+#ifdef _WIN32
+	// no pread, so seek, read and put the reader back where it was
+	{
+		long long resume = d->offset + d->len;
+		size_t n;
+		if (d->fp) {
+			n = _fseeki64(d->fp, offset, SEEK_SET) ? 0 : fread(dst, 1, len, d->fp);
+			_fseeki64(d->fp, resume, SEEK_SET);
+		} else {
+			n = _lseeki64(d->fd, offset, SEEK_SET) < 0 ? 0 : (size_t) _read(d->fd, dst, (unsigned int) len);
+			_lseeki64(d->fd, resume, SEEK_SET);
+		}
+		if (n != len)
+			return ppm_fail(d, "Unexpected end of file.");
+	}
+#else
+	{
+		int fd = d->fp ? fileno(d->fp) : d->fd;
+		char* p = dst;
+		while (len > 0) {
+			ssize_t n = pread(fd, p, len, (off_t) offset);
+			if (n <= 0)
+				return ppm_fail(d, "Unexpected end of file.");
+			p += n;
+			offset += n;
+			len -= (size_t) n;
+			d->bytes_read += n;
+		}
+	}
+#endif
+
+	return 0;
+}
+
+static int ppm_getc(PpmDecoder* d)
+{
+	if (d->pos >= d->len && !ppm_fill(d))
+		return EOF;
+	return d->buf[d->pos++];
+}
+
+// skips whitespace and comments, returns the first other character
+static int ppm_skip(PpmDecoder* d)
+{
+	int c = ppm_getc(d);
+
+	while (isspace(c) || c == '#') {
+		if (c == '#')
+			while (c != '\n' && c != EOF)
+				c = ppm_getc(d);
+		c = ppm_getc(d);
+	}
+
+	return c;
+}
+
+// reads a non negative decimal number, -1 if there isn't one
+static int ppm_number(PpmDecoder* d, int first)
+{
+	int c = first;
+	int v = 0;
+
+	if (!isdigit(c))
+		return -1;
+	while (isdigit(c)) {
+		if (v > 100000000)
+			return -1;
+		v = v*10 + (c - '0');
+		c = ppm_getc(d);
+	}
+	// give back the terminator so the caller sees it
+	if (c != EOF)
+		d->pos--;
+
+	return v;
+}
+
+static void qoi_reset(PpmDecoder* d)
+{
+	memset(d->qoi_index, 0, sizeof(d->qoi_index));
+	d->qoi_px[0] = 0;
+	d->qoi_px[1] = 0;
+	d->qoi_px[2] = 0;
+	d->qoi_px[3] = 255;
+	d->qoi_run = 0;
+}
+
+// the 'q' is already consumed, 13 header bytes remain
+static int read_qoi_header(PpmDecoder* d)
+{
+	unsigned char hdr[QOI_HEADER_SIZE - 1];
+
+	for (int i=0; i<QOI_HEADER_SIZE - 1; i++) {
+		int c = ppm_getc(d);
+		if (c == EOF)
+			return ppm_fail(d, "Invalid header.");
+		hdr[i] = (unsigned char) c;
+	}
+	if (memcmp(hdr, "oif", 3))
+		return ppm_fail(d, "Invalid image format. Needs to be either 'P3', 'P6' or QOI.");
+
+	unsigned int w = (unsigned int) hdr[3] << 24 | hdr[4] << 16 | hdr[5] << 8 | hdr[6];
+	unsigned int h = (unsigned int) hdr[7] << 24 | hdr[8] << 16 | hdr[9] << 8 | hdr[10];
+	if (w < 1 || h < 1 || w > 100000000 || h > 100000000)
+		return ppm_fail(d, "Invalid dimensions.");
+	if (hdr[11] != 3 && hdr[11] != 4)
+		return ppm_fail(d, "Invalid header.");
+
+	d->format = 'q';
+	d->w = (int) w;
+	d->h = (int) h;
+	d->mc = CHANNEL_SIZE;
+	d->row = 0;
+	d->data = d->offset + (long long) d->pos;
+	qoi_reset(d);
+	return 0;
+}
+
+static int read_header(PpmDecoder* d)
+{
+	int c = ppm_skip(d);
+
+	if (c == 'q')
+		return read_qoi_header(d);
+
+	// checks that source is either P3 or P6
+	if (c != 'P')
+		return ppm_fail(d, "Invalid image format. Needs to be either 'P3', 'P6' or QOI.");
+	d->format = (char) ppm_getc(d);
+	if (d->format != '3' && d->format != '6')
+		return ppm_fail(d, "Invalid image format. Needs to be either 'P3', 'P6' or QOI.");
+
+	d->w = ppm_number(d, ppm_skip(d));
+	d->h = ppm_number(d, ppm_skip(d));
+	if (d->h < 1 || d->w < 1)
+		return ppm_fail(d, "Invalid dimensions.");
+
+	d->mc = ppm_number(d, ppm_skip(d));
+	if (d->mc != CHANNEL_SIZE)
+		return ppm_fail(d, "Channel size must be 8 bits.");
+
+	// exactly one whitespace before the data
+	if (!isspace(ppm_getc(d)))
+		return ppm_fail(d, "Invalid header.");
+
+	d->row = 0;
+	d->data = d->offset + (long long) d->pos;
+
+	// filled in as rows are passed, so later crops can seek
+	if (d->format == '3') {
+		int entries = (d->h + PPM_INDEX_STEP - 1) / PPM_INDEX_STEP;
+		d->row_index = malloc(sizeof(long long) * entries);
+		if (!d->row_index)
+			return ppm_fail(d, "Out of memory.");
+		for (int i=0; i<entries; i++)
+			d->row_index[i] = -1;
+		d->row_index[0] = d->data;
+	}
+
+	return 0;
+}
+
+// a source that failed says why, rather than the decoder seeing a short file;
+// after the last row the rest of the stream is checked too
+static int check_source(PpmDecoder* d, int status)
+{
+	const char* error;
+
+	if (d->status && (status || d->row == d->h) && (error = d->status(d->user)))
+		return ppm_fail(d, "%s", error);
+	return status;
+}
+
+int ppm_read_header(PpmDecoder* d)
+{
+	long long span = trace_begin();
+	int status = read_header(d);
+	trace_end("ppm_read_header", span);
+	return status ? check_source(d, status) : 0;
+}
+
+// P6 rows are the raw bytes, copied straight out of the buffer
+static int decode_raw(PpmDecoder* d, unsigned char* dst, size_t n)
+{
+	while (n > 0) {
+		size_t avail = ppm_fill(d);
+		size_t m = avail < n ? avail : n;
+
+		if (!avail)
+			return ppm_fail(d, "Unexpected end of file.");
+		if (dst) {
+			memcpy(dst, d->buf + d->pos, m);
+			dst += m;
+		}
+		d->pos += m;
+		n -= m;
+	}
+	return 0;
+}
+
+static int decode_ascii(PpmDecoder* d, unsigned char* dst, size_t n)
+{
+	for (size_t i=0; i<n; i++) {
+		int v = ppm_number(d, ppm_skip(d));
+		if (v < 0)
+			return ppm_fail(d, "Unexpected end of file.");
+		if (dst)
+			dst[i] = (unsigned char) v;
+	}
+	return 0;
+}
+
+// QOI ops straight out of the buffer into n pixels, dst may be NULL to skip them
+static int decode_qoi(PpmDecoder* d, Color* dst, size_t n)
+{
+	unsigned char (*index)[4] = d->qoi_index;
+	unsigned char* px = d->qoi_px;
+	int run = d->qoi_run;
+
+	for (size_t i=0; i<n; i++) {
+		if (run > 0) {
+			run--;
+		} else {
+			// the longest op is 5 bytes, only top up when near the end of the buffer
+			size_t avail = d->len - d->pos;
+			if (avail < 5 && (avail = ppm_ensure(d, 5)) == 0)
+				return ppm_fail(d, "Unexpected end of file.");
+
+			const unsigned char* p = d->buf + d->pos;
+			int b1 = p[0];
+			size_t used = 1;
+
+			if (b1 == QOI_OP_RGB) {
+				px[0] = p[1];
+				px[1] = p[2];
+				px[2] = p[3];
+				used = 4;
+			} else if (b1 == QOI_OP_RGBA) {
+				px[0] = p[1];
+				px[1] = p[2];
+				px[2] = p[3];
+				px[3] = p[4];
+				used = 5;
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+				memcpy(px, index[b1], 4);
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+				px[0] += ((b1 >> 4) & 3) - 2;
+				px[1] += ((b1 >> 2) & 3) - 2;
+				px[2] += (b1 & 3) - 2;
+			} else if ((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+				int vg = (b1 & 0x3f) - 32;
+				if (avail >= 2) {
+					px[0] += vg - 8 + ((p[1] >> 4) & 0x0f);
+					px[1] += vg;
+					px[2] += vg - 8 + (p[1] & 0x0f);
+				}
+				used = 2;
+			} else {
+				run = b1 & 0x3f;
+			}
+
+			if (used > avail)
+				return ppm_fail(d, "Unexpected end of file.");
+			d->pos += used;
+			memcpy(index[QOI_HASH(px[0], px[1], px[2], px[3])], px, 4);
+		}
+
+		if (dst) {
+			dst[i].r = px[0];
+			dst[i].g = px[1];
+			dst[i].b = px[2];
+		}
+	}
+
+	d->qoi_run = run;
+	return 0;
+}
+
+static int decode_samples(PpmDecoder* d, unsigned char* dst, size_t n)
+{
+	if (d->format == 'q')
+		return decode_qoi(d, (Color*) dst, n / 3);
+	return d->format == '6' ? decode_raw(d, dst, n) : decode_ascii(d, dst, n);
+}
+
+// decodes columns x..x+n of the next row, dst may be NULL to skip it
+static int decode_row(PpmDecoder* d, Color* dst, int x, int n)
+{
+	// remember where P3 rows start as they go by
+	if (d->row_index && d->row % PPM_INDEX_STEP == 0 && d->row_index[d->row / PPM_INDEX_STEP] < 0) {
+		int c = ppm_skip(d);
+		if (c == EOF)
+			return ppm_fail(d, "Unexpected end of file.");
+		d->pos--;
+		d->row_index[d->row / PPM_INDEX_STEP] = d->offset + (long long) d->pos;
+	}
+
+	if (decode_samples(d, NULL, (size_t) x * 3)
+			|| decode_samples(d, (unsigned char*) dst, (size_t) n * 3)
+			|| decode_samples(d, NULL, (size_t) (d->w - x - n) * 3))
+		return -1;
+
+	d->row++;
+	return 0;
+}
+
+// positions the reader at the start of row, seeking when the source allows it
+static int seek_row(PpmDecoder* d, int row)
+{
+	if (row == d->row)
+		return 0;
+
+	if (d->format == '6' && ppm_seekable(d)) {
+		if (ppm_seek(d, d->data + (long long) row * d->w * sizeof(Color)))
+			return -1;
+		d->row = row;
+		return 0;
+	}
+
+	// QOI ops depend on everything before them, so going back starts over
+	if (d->format == 'q' && row < d->row && ppm_seekable(d)) {
+		if (ppm_seek(d, d->data))
+			return -1;
+		qoi_reset(d);
+		d->row = 0;
+	}
+
+	// P3: closest indexed row at or before the target, unless reading on is nearer
+	if (d->row_index && ppm_seekable(d)) {
+		int k = row / PPM_INDEX_STEP;
+		while (k > 0 && d->row_index[k] < 0)
+			k--;
+		if (d->row > row || d->row < k * PPM_INDEX_STEP) {
+			if (ppm_seek(d, d->row_index[k]))
+				return -1;
+			d->row = k * PPM_INDEX_STEP;
+		}
+	}
+
+	if (row < d->row)
+		return ppm_fail(d, "Invalid row range.");
+	while (d->row < row)
+		if (decode_row(d, NULL, 0, 0))
+			return -1;
+
+	return 0;
+}
+
+int ppm_decode_rows(PpmDecoder* d, int first, int count, Color* dst)
+{
+	long long span = trace_begin();
+	int status = 0;
+
+	if (first < 0 || count < 0 || first + count > d->h)
+		return ppm_fail(d, "Invalid row range.");
+
+	if (seek_row(d, first)) {
+		status = -1;
+	} else if (d->format == '6' || d->format == 'q') {
+		// whole rows are contiguous, so decode them in one go
+		if (decode_samples(d, (unsigned char*) dst, (size_t) count * d->w * sizeof(Color)))
+			status = -1;
+		else
+			d->row += count;
+	} else {
+		for (int r=0; r<count && status == 0; r++)
+			status = decode_row(d, dst + (size_t) r * d->w, 0, d->w);
+	}
+
+	trace_end(d->format == '6' ? "ppm_decode_p6" : (d->format == 'q' ? "ppm_decode_qoi" : "ppm_decode_p3"), span);
+	return check_source(d, status);
+}
+
+int ppm_decode_rect(PpmDecoder* d, int x, int y, int w, int h, Color* dst)
+{
+	long long span = trace_begin();
+	int status = 0;
+
+	if (x < 0 || y < 0 || w < 1 || h < 1 || x + w > d->w || y + h > d->h)
+		return ppm_fail(d, "Invalid crop rectangle.");
+
+	if (d->format == '6' && ppm_seekable(d)) {
+		// fixed stride, so each row span is read straight from its offset
+		for (int r=0; r<h && status == 0; r++) {
+			long long offset = d->data + ((long long) (y + r) * d->w + x) * sizeof(Color);
+			status = ppm_pread(d, offset, dst + (size_t) r * w, (size_t) w * sizeof(Color));
+		}
+	} else if (seek_row(d, y)) {
+		status = -1;
+	} else {
+		for (int r=0; r<h && status == 0; r++)
+			status = decode_row(d, dst + (size_t) r * w, x, w);
+	}
+
+	trace_end("ppm_decode_rect", span);
+	return check_source(d, status);
+}
+
+int ppm_decode(PpmDecoder* d, Color* dst)
+{
+	return ppm_decode_rows(d, d->row, d->h - d->row, dst);
+}
+
+void ppm_close(PpmDecoder* d)
+{
+	if (d->release)
+		d->release(d->user);
+	if (d->owns && d->fp)
+		fclose(d->fp);
+	if (d->owns && d->fd >= 0)
+#ifdef _WIN32
+		_close(d->fd);
+#else
+		close(d->fd);
+#endif
+	free(d->store);
+	free(d->row_index);
+	d->row_index = NULL;
+	d->fp = NULL;
+	d->fd = -1;
+	d->store = NULL;
+	d->buf = NULL;
+	d->release = NULL;
+	d->user = NULL;
+}
+
+Color* ppm_load(PpmDecoder* d, const char* path)
+{
+	Color* pixels = NULL;
+
+	if (ppm_open_path(d, path) == 0 && ppm_read_header(d) == 0) {
+		pixels = pool_alloc(sizeof(Color) * (size_t) d->w * d->h);
+		if (!pixels)
+			ppm_fail(d, "Out of memory.");
+		else if (ppm_decode(d, pixels)) {
+			pool_free(pixels);
+			pixels = NULL;
+		}
+	}
+
+	ppm_close(d);
+	return pixels;
+}
+
+// writes pixels to path as P6
+int ppm_write(const char* path, const Color* pixels, int w, int h)
+{
+	FILE* fp = fopen(path, "wb");
+
+	if (!fp)
+		return -1;
+
+	fprintf(fp, "P6\n%d %d\n%d\n", w, h, CHANNEL_SIZE);
+	if (fwrite(pixels, sizeof(Color), (size_t) h*w, fp) != (size_t) h*w) {
+		fclose(fp);
+		return -1;
+	}
+
+	return fclose(fp) ? -1 : 0;
+}
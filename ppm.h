@@ -0,0 +1,85 @@
+/*
+ * File:   ppm.h
+ * Author: Matthew
+ *
+ * Reentrant P3/P6 and QOI decoder. All state lives in the PpmDecoder, so
+ * separate decoders can run on separate threads at the same time.
+ */
+
+#ifndef PPM_H
+#define PPM_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#include "ezview.h"
+
+#define PPM_BUFSIZE (1 << 16)
+// P3 rows between entries of the row offset index
+#define PPM_INDEX_STEP 16
+
+// stream source callback, returns bytes read and 0 at end of input
+typedef size_t (*ppm_read_fn)(void* user, void* buf, size_t len);
+
+typedef struct {
+	// source
+	ppm_read_fn read;
+	void* user;
+	FILE* fp;
+	int fd;
+	int owns;                   // fp or fd is closed by ppm_close
+	void (*release)(void* user);  // frees user in ppm_close, for sources that own it
+	const char* (*status)(void* user);  // error of a stream source that ended badly, or NULL
+
+	// read buffer, points straight at the data for memory sources
+	const unsigned char* buf;
+	unsigned char* store;
+	size_t pos;
+	size_t len;
+	int eof;
+	int memory;
+	long long offset;           // source offset of buf[0]
+	long long bytes_read;       // bytes taken from the source so far
+
+	// header
+	char format;                // '3', '6' or 'q' for QOI
+	int w;
+	int h;
+	int mc;
+	int row;                    // next row to be decoded
+	long long data;             // source offset of the first sample
+	long long* row_index;       // P3 only, offset of every PPM_INDEX_STEP'th row or -1
+
+	// QOI decoder state, carried between rows
+	unsigned char qoi_index[64][4];
+	unsigned char qoi_px[4];
+	int qoi_run;
+
+	char error[128];
+} PpmDecoder;
+
+// gzip and zstd files are recognized and decompressed on the fly
+int ppm_open_path(PpmDecoder* d, const char* path);
+int ppm_open_fd(PpmDecoder* d, int fd);
+int ppm_open_memory(PpmDecoder* d, const void* data, size_t len);
+int ppm_open_stream(PpmDecoder* d, ppm_read_fn read, void* user);
+
+int ppm_read_header(PpmDecoder* d);
+// 1 if earlier rows can be read again without opening the source again
+int ppm_seekable(const PpmDecoder* d);
+// decodes count rows starting at first into dst; going back to an earlier
+// row needs a path, fd or memory source
+int ppm_decode_rows(PpmDecoder* d, int first, int count, Color* dst);
+// decodes only the w by h rectangle at x, y; P6 reads just those bytes, P3
+// seeks through the row index built up by earlier passes over the data and
+// QOI has to decode everything up to the last row
+int ppm_decode_rect(PpmDecoder* d, int x, int y, int w, int h, Color* dst);
+int ppm_decode(PpmDecoder* d, Color* dst);
+void ppm_close(PpmDecoder* d);
+
+// open, decode into a new pool buffer and close; the size is left in d->w and d->h
+// and the buffer goes back with pool_free
+Color* ppm_load(PpmDecoder* d, const char* path);
+int ppm_write(const char* path, const Color* pixels, int w, int h);
+
+#endif
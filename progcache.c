@@ -0,0 +1,257 @@
+/*
+ * File:   progcache.c
+ * Author: Matthew
+ *
+ * Programs are keyed by a hash of both shader sources and the GL vendor,
+ * renderer and version strings, so a driver update simply misses and the
+ * program is compiled and stored again. Any binary the driver refuses is
+ * treated the same way.
+ */
+
+#include "progcache.h"
+#include "trace.h"
+
+#include <GLES2/gl2ext.h>
+#include <GLFW/glfw3.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#define make_dir(path) _mkdir(path)
+#define process_id() _getpid()
+#else
+#include <unistd.h>
+#define make_dir(path) mkdir(path, 0755)
+#define process_id() getpid()
+#endif
+
+#define CACHE_MAGIC 0x42505a45 // "EZPB"
+
+typedef struct {
+	unsigned int magic;
+	unsigned int format;
+	unsigned int length;
+	unsigned int reserved;
+	unsigned long long key;
+} CacheHeader;
+
+static PFNGLGETPROGRAMBINARYOESPROC get_program_binary;
+static PFNGLPROGRAMBINARYOESPROC program_binary;
+static char cache_dir[1024];
+static int enabled;
+
+static unsigned long long hash(unsigned long long h, const char* s)
+{
+	// FNV-1a, the terminator is hashed too so "ab"+"c" differs from "a"+"bc"
+	do {
+		h ^= (unsigned char) *s;
+		h *= 1099511628211ULL;
+	} while (*s++);
+	return h;
+}
+
+static unsigned long long program_key(const char* vs_text, const char* fs_text)
+{
+	unsigned long long h = 14695981039346656037ULL;
+	const char* vendor = (const char*) glGetString(GL_VENDOR);
+	const char* renderer = (const char*) glGetString(GL_RENDERER);
+	const char* version = (const char*) glGetString(GL_VERSION);
+
+	h = hash(h, vs_text);
+	h = hash(h, fs_text);
+	h = hash(h, vendor ? vendor : "");
+	h = hash(h, renderer ? renderer : "");
+	return hash(h, version ? version : "");
+}
+
+static void cache_path(char* path, size_t size, unsigned long long key)
+{
+	snprintf(path, size, "%s/%016llx.bin", cache_dir, key);
+}
+
+void progcache_init()
+{
+	const char* base = getenv("XDG_CACHE_HOME");
+	const char* home = getenv("HOME");
+	GLint formats = 0;
+
+	enabled = 0;
+	if (!glfwExtensionSupported("GL_OES_get_program_binary"))
+		return;
+
+	get_program_binary = (PFNGLGETPROGRAMBINARYOESPROC) glfwGetProcAddress("glGetProgramBinaryOES");
+	program_binary = (PFNGLPROGRAMBINARYOESPROC) glfwGetProcAddress("glProgramBinaryOES");
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS_OES, &formats);
+	if (!get_program_binary || !program_binary || formats < 1)
+		return;
+
+	// $XDG_CACHE_HOME/ezview, falling back to ~/.cache/ezview
+#ifdef _WIN32
+	if (!base || !*base)
+		base = getenv("LOCALAPPDATA");
+#endif
+	if (base && *base) {
+		snprintf(cache_dir, sizeof(cache_dir), "%s/ezview", base);
+	} else if (home && *home) {
+		snprintf(cache_dir, sizeof(cache_dir), "%s/.cache", home);
+		make_dir(cache_dir);
+		snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/ezview", home);
+	} else {
+		return;
+	}
+	make_dir(cache_dir);
+
+	enabled = 1;
+}
+
+GLuint progcache_load(const char* vs_text, const char* fs_text)
+{
+	char path[1100];
+	CacheHeader header;
+	void* binary;
+	GLuint program = 0;
+	GLint linked = 0;
+	FILE* fp;
+
+	if (!enabled)
+		return 0;
+
+	header.key = program_key(vs_text, fs_text);
+	cache_path(path, sizeof(path), header.key);
+	fp = fopen(path, "rb");
+	if (!fp)
+		return 0;
+
+	// a damaged entry is removed so the rebuilt program can replace it
+	if (fread(&header, sizeof(header), 1, fp) != 1 || header.magic != CACHE_MAGIC
+			|| header.key != program_key(vs_text, fs_text) || header.length == 0) {
+		fclose(fp);
+		remove(path);
+		return 0;
+	}
+
+	binary = malloc(header.length);
+	if (!binary) {
+		fclose(fp);
+		return 0;
+	}
+	if (fread(binary, 1, header.length, fp) == header.length) {
+		program = glCreateProgram();
+		program_binary(program, header.format, binary, (GLint) header.length);
+		glGetProgramiv(program, GL_LINK_STATUS, &linked);
+		if (!linked) {
+			// stale or foreign binary, build from source instead
+			glDeleteProgram(program);
+			program = 0;
+		}
+	}
+
+	free(binary);
+	fclose(fp);
+	if (!program)
+		remove(path);
+	return program;
+}
+
+void progcache_store(GLuint program, const char* vs_text, const char* fs_text)
+{
+	char path[1100];
+	char tmp[1130];
+	CacheHeader header;
+	GLint length = 0;
+	GLint linked = 0;
+	GLenum format;
+	void* binary;
+	FILE* fp;
+
+	if (!enabled)
+		return;
+
+	// a program that failed to link would fail again on every start
+	glGetProgramiv(program, GL_LINK_STATUS, &linked);
+	if (!linked)
+		return;
+
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH_OES, &length);
+	if (length <= 0)
+		return;
+	binary = malloc(length);
+	if (!binary)
+		return;
+	get_program_binary(program, length, &length, &format, binary);
+
+	header.magic = CACHE_MAGIC;
+	header.format = format;
+	header.length = (unsigned int) length;
+	header.reserved = 0;
+	header.key = program_key(vs_text, fs_text);
+	cache_path(path, sizeof(path), header.key);
+
+	// write to a temporary name of this process's own so a concurrent start
+	// never reads or renames half a file
+	snprintf(tmp, sizeof(tmp), "%s.%d.tmp", path, (int) process_id());
+	fp = fopen(tmp, "wb");
+	if (fp) {
+		int ok = fwrite(&header, sizeof(header), 1, fp) == 1
+			&& fwrite(binary, 1, length, fp) == (size_t) length;
+		if (fclose(fp) == 0 && ok && rename(tmp, path) == 0)
+			tmp[0] = '\0';
+		if (tmp[0])
+			remove(tmp);
+	}
+
+	free(binary);
+}
+
+static void glCompileShaderOrDie(GLuint shader)
+{
+	GLint compiled;
+	long long span = trace_begin();
+	glCompileShader(shader);
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &compiled);
+	trace_end("compile_shader", span);
+
+	if (!compiled) {
+		GLint infoLen = 0;
+		glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &infoLen);
+
+		char* info = malloc(infoLen+1);
+		GLint done;
+		glGetShaderInfoLog(shader, infoLen, &done, info);
+		printf("Unable to compile shader: %s\n", info);
+		exit(1);
+	}
+}
+
+// a program the cache doesn't have is stored once it links
+GLuint build_program(const char* vs_text, const char* fs_text)
+{
+	long long span = trace_begin();
+	GLuint program = progcache_load(vs_text, fs_text);
+	trace_end("progcache_load", span);
+	if (program)
+		return program;
+
+	GLuint vs = glCreateShader(GL_VERTEX_SHADER);
+	glShaderSource(vs, 1, &vs_text, NULL);
+	glCompileShaderOrDie(vs);
+
+	GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
+	glShaderSource(fs, 1, &fs_text, NULL);
+	glCompileShaderOrDie(fs);
+
+	program = glCreateProgram();
+	glAttachShader(program, vs);
+	glAttachShader(program, fs);
+	span = trace_begin();
+	glLinkProgram(program);
+	trace_end("link_program", span);
+
+	progcache_store(program, vs_text, fs_text);
+	return program;
+}
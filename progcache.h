@@ -0,0 +1,23 @@
+/* 
+ * File:   progcache.h
+ * Author: Matthew
+ *
+ * On disk cache of linked shader programs through GL_OES_get_program_binary,
+ * and the program builder that goes through it.
+ */
+
+#ifndef PROGCACHE_H
+#define PROGCACHE_H
+
+#include <GLES2/gl2.h>
+
+// looks for the cache directory and the extension, needs a current context
+void progcache_init();
+// returns a linked program from the cache, or 0 if it has to be built
+GLuint progcache_load(const char* vs_text, const char* fs_text);
+void progcache_store(GLuint program, const char* vs_text, const char* fs_text);
+// compiles and links a program from vertex and fragment source, or loads
+// the linked binary from the cache; exits if a shader doesn't compile
+GLuint build_program(const char* vs_text, const char* fs_text);
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * File:   qoi.c
+ * Author: Matthew
+ *
+ * Straight QOI encoder, writing 3 channel sRGB images through a fixed size
+ * output buffer.
+ */
+
+#include "qoi.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define OUT_SIZE (1 << 16)
+
+static const unsigned char qoi_end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+static void put_u32(unsigned char* p, unsigned int v)
+{
+	p[0] = (unsigned char) (v >> 24);
+	p[1] = (unsigned char) (v >> 16);
+	p[2] = (unsigned char) (v >> 8);
+	p[3] = (unsigned char) v;
+}
+
+int qoi_path(const char* path)
+{
+	size_t n = strlen(path);
+	return n > 4 && !strcmp(path + n - 4, ".qoi");
+}
+
+int qoi_write(const char* path, const Color* pixels, int w, int h)
+{
+	unsigned char out[OUT_SIZE];
+	unsigned char index[64][4];     // RGBA like the decoder's, so empty slots never match
+	unsigned char pr = 0, pg = 0, pb = 0;
+	size_t n = (size_t) w * h;
+	size_t o = 0;
+	int run = 0;
+	int ok = 1;
+	FILE* fp = fopen(path, "wb");
+
+	if (!fp)
+		return -1;
+
+	memcpy(out, "qoif", 4);
+	put_u32(out + 4, (unsigned int) w);
+	put_u32(out + 8, (unsigned int) h);
+	out[12] = 3;
+	out[13] = 0;
+	o = QOI_HEADER_SIZE;
+	memset(index, 0, sizeof(index));
+
+	for (size_t i=0; i<n; i++) {
+		unsigned char r = pixels[i].r, g = pixels[i].g, b = pixels[i].b;
+
+		// room for the largest op plus a pending run
+		if (o > OUT_SIZE - 8) {
+			ok = ok && fwrite(out, 1, o, fp) == o;
+			o = 0;
+		}
+
+		if (r == pr && g == pg && b == pb) {
+			if (++run == 62 || i == n-1) {
+				out[o++] = (unsigned char) (QOI_OP_RUN | (run - 1));
+				run = 0;
+			}
+			continue;
+		}
+		if (run > 0) {
+			out[o++] = (unsigned char) (QOI_OP_RUN | (run - 1));
+			run = 0;
+		}
+
+		int slot = QOI_HASH(r, g, b, 255);
+		if (index[slot][0] == r && index[slot][1] == g && index[slot][2] == b && index[slot][3] == 255) {
+			out[o++] = (unsigned char) (QOI_OP_INDEX | slot);
+		} else {
+			signed char dr = (signed char) (r - pr);
+			signed char dg = (signed char) (g - pg);
+			signed char db = (signed char) (b - pb);
+			signed char dr_dg = (signed char) (dr - dg);
+			signed char db_dg = (signed char) (db - dg);
+
+			index[slot][0] = r;
+			index[slot][1] = g;
+			index[slot][2] = b;
+			index[slot][3] = 255;
+
+			if (dr > -3 && dr < 2 && dg > -3 && dg < 2 && db > -3 && db < 2) {
+				out[o++] = (unsigned char) (QOI_OP_DIFF | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+			} else if (dr_dg > -9 && dr_dg < 8 && dg > -33 && dg < 32 && db_dg > -9 && db_dg < 8) {
+				out[o++] = (unsigned char) (QOI_OP_LUMA | (dg + 32));
+				out[o++] = (unsigned char) ((dr_dg + 8) << 4 | (db_dg + 8));
+			} else {
+				out[o++] = QOI_OP_RGB;
+				out[o++] = r;
+				out[o++] = g;
+				out[o++] = b;
+			}
+		}
+		pr = r;
+		pg = g;
+		pb = b;
+	}
+
+	if (o > OUT_SIZE - sizeof(qoi_end)) {
+		ok = ok && fwrite(out, 1, o, fp) == o;
+		o = 0;
+	}
+	memcpy(out + o, qoi_end, sizeof(qoi_end));
+	o += sizeof(qoi_end);
+	ok = ok && fwrite(out, 1, o, fp) == o;
+
+	return fclose(fp) == 0 && ok ? 0 : -1;
+}
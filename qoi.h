@@ -0,0 +1,29 @@
+/* 
+ * File:   qoi.h
+ * Author: Matthew
+ *
+ * "Quite OK Image" format, a fast lossless alternative to raw PPM. Decoding
+ * goes through the PpmDecoder, this is the encoder and the shared constants.
+ */
+
+#ifndef QOI_H
+#define QOI_H
+
+#include "ezview.h"
+
+#define QOI_HEADER_SIZE 14
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
+
+#define QOI_HASH(r, g, b, a) (((r)*3 + (g)*5 + (b)*7 + (a)*11) % 64)
+
+int qoi_write(const char* path, const Color* pixels, int w, int h);
+// 1 if path ends in .qoi
+int qoi_path(const char* path);
+
+#endif
@@ -0,0 +1,232 @@
+/*
+ * File:   replay.c
+ * Author: Matthew
+ *
+ * The file is a 'EZVR' header and version byte followed by events: the frame
+ * and microsecond deltas from the previous event as varints, a type byte and
+ * the payload, so a key press takes about six bytes. An end event marks the
+ * frame and time the recording stopped.
+ */
+
+#include "replay.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define REPLAY_VERSION 1
+
+static void put_varint(FILE* fp, unsigned long long v)
+{
+	while (v >= 0x80) {
+		fputc((int) (v & 0x7f) | 0x80, fp);
+		v >>= 7;
+	}
+	fputc((int) v, fp);
+}
+
+static int get_varint(FILE* fp, unsigned long long* v)
+{
+	int shift = 0;
+	int c;
+
+	*v = 0;
+	do {
+		if ((c = fgetc(fp)) == EOF || shift > 63)
+			return -1;
+		*v |= (unsigned long long) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+	return 0;
+}
+
+// scancodes can be -1, so signed values are zigzag encoded
+static unsigned long long zigzag(int v)
+{
+	return v < 0 ? ((unsigned long long) -(long long) v << 1) - 1 : (unsigned long long) v << 1;
+}
+
+static int unzigzag(unsigned long long v)
+{
+	return v & 1 ? -(int) ((v + 1) >> 1) : (int) (v >> 1);
+}
+
+static void write_event(Replay* r, double now, int type)
+{
+	unsigned long long us = (unsigned long long) ((now - r->start) * 1e6);
+
+	if (us < r->last_us)
+		us = r->last_us;
+	put_varint(r->fp, r->frame - r->last_frame);
+	put_varint(r->fp, us - r->last_us);
+	fputc(type, r->fp);
+	r->last_frame = r->frame;
+	r->last_us = us;
+}
+
+static int read_event(Replay* r)
+{
+	unsigned long long frames, us, a, b, c;
+	int type;
+	ReplayEvent* e = &r->next;
+
+	memset(e, 0, sizeof(ReplayEvent));
+	if (get_varint(r->fp, &frames) || get_varint(r->fp, &us) || (type = fgetc(r->fp)) == EOF)
+		return -1;
+	e->type = type;
+	e->frame = r->last_frame + (unsigned long) frames;
+	e->us = r->last_us + us;
+	r->last_frame = e->frame;
+	r->last_us = e->us;
+
+	if (type == REPLAY_KEY) {
+		if (get_varint(r->fp, &a) || get_varint(r->fp, &b) || get_varint(r->fp, &c))
+			return -1;
+		e->key = unzigzag(a);
+		e->scancode = unzigzag(b);
+		e->action = (int) (c & 0xff);
+		e->mods = (int) (c >> 8);
+	} else if (type == REPLAY_SIZE) {
+		if (get_varint(r->fp, &a) || get_varint(r->fp, &b))
+			return -1;
+		e->w = (int) a;
+		e->h = (int) b;
+	} else if (type != REPLAY_END) {
+		return -1;
+	}
+	return 0;
+}
+
+int replay_record(Replay* r, const char* path, double now)
+{
+	memset(r, 0, sizeof(Replay));
+	r->fp = fopen(path, "wb");
+	if (!r->fp)
+		return -1;
+	fwrite("EZVR", 1, 4, r->fp);
+	fputc(REPLAY_VERSION, r->fp);
+	r->recording = 1;
+	r->start = now;
+	return 0;
+}
+
+int replay_play(Replay* r, const char* path, int real_time, double now)
+{
+	char magic[5];
+
+	memset(r, 0, sizeof(Replay));
+	r->fp = fopen(path, "rb");
+	if (!r->fp)
+		return -1;
+	if (fread(magic, 1, 5, r->fp) != 5 || memcmp(magic, "EZVR", 4) || magic[4] != REPLAY_VERSION) {
+		fclose(r->fp);
+		r->fp = NULL;
+		return -1;
+	}
+	r->playing = 1;
+	r->real_time = real_time;
+	r->start = now;
+	r->has_next = read_event(r) == 0;
+	return 0;
+}
+
+void replay_key(Replay* r, double now, int key, int scancode, int action, int mods)
+{
+	if (!r->recording)
+		return;
+	write_event(r, now, REPLAY_KEY);
+	put_varint(r->fp, zigzag(key));
+	put_varint(r->fp, zigzag(scancode));
+	put_varint(r->fp, (unsigned long long) (action & 0xff) | (unsigned long long) (mods & 0xffff) << 8);
+}
+
+void replay_size(Replay* r, double now, int w, int h)
+{
+	if (!r->recording)
+		return;
+	write_event(r, now, REPLAY_SIZE);
+	put_varint(r->fp, (unsigned long long) w);
+	put_varint(r->fp, (unsigned long long) h);
+}
+
+int replay_next(Replay* r, double now, ReplayEvent* e)
+{
+	unsigned long due;
+
+	if (!r->playing || !r->has_next)
+		return 0;
+
+	// keys came in after their frame was drawn, so they apply from the next
+	// one, and the end closes the window during the last recorded frame
+	if (r->next.type == REPLAY_END)
+		due = r->next.frame ? r->next.frame - 1 : 0;
+	else
+		due = r->next.frame + 1;
+	if (r->real_time ? (now - r->start) * 1e6 < (double) r->next.us : r->frame < due)
+		return 0;
+
+	*e = r->next;
+	// a truncated file just ends the replay early
+	r->has_next = e->type != REPLAY_END && read_event(r) == 0;
+	if (!r->has_next && e->type != REPLAY_END) {
+		r->next.type = REPLAY_END;
+		r->next.frame = e->frame + 2;
+		r->next.us = e->us;
+		r->has_next = 1;
+	}
+	return 1;
+}
+
+void replay_frame(Replay* r, double frame_time)
+{
+	// events are due by frame, so the count moves on even when the time
+	// can't be kept
+	r->frame++;
+	if (r->frame_count == r->frame_cap) {
+		size_t cap = r->frame_cap ? r->frame_cap * 2 : 1024;
+		double* times = realloc(r->frame_times, sizeof(double) * cap);
+		if (!times)
+			return;
+		r->frame_times = times;
+		r->frame_cap = cap;
+	}
+	r->frame_times[r->frame_count++] = frame_time;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+	double x = *(const double*) a, y = *(const double*) b;
+	return x < y ? -1 : x > y;
+}
+
+void replay_write_stats(const Replay* r, FILE* fp)
+{
+	size_t n = r->frame_count;
+	double* sorted = malloc(sizeof(double) * (n ? n : 1));
+	double total = 0;
+
+	if (!sorted || n == 0) {
+		fprintf(fp, "{\"frames\": 0}\n");
+		free(sorted);
+		return;
+	}
+	memcpy(sorted, r->frame_times, sizeof(double) * n);
+	qsort(sorted, n, sizeof(double), compare_double);
+	for (size_t i=0; i<n; i++)
+		total += sorted[i];
+
+	fprintf(fp, "{\"frames\": %lu, \"seconds\": %.3f, \"fps\": %.2f, \"frame_ms\": {\"mean\": %.3f, \"min\": %.3f, "
+		"\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}}\n",
+		(unsigned long) n, total, total > 0 ? n / total : 0, total / n * 1000, sorted[0] * 1000,
+		sorted[n/2] * 1000, sorted[n*9/10] * 1000, sorted[n*99/100] * 1000, sorted[n-1] * 1000);
+	free(sorted);
+}
+
+void replay_close(Replay* r, double now)
+{
+	if (r->recording)
+		write_event(r, now, REPLAY_END);
+	if (r->fp)
+		fclose(r->fp);
+	free(r->frame_times);
+	memset(r, 0, sizeof(Replay));
+}
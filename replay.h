@@ -0,0 +1,60 @@
+/* 
+ * File:   replay.h
+ * Author: Matthew
+ *
+ * Records key presses and window size changes with the frame and time they
+ * happened, and plays them back either on the same frames or at the same
+ * times, so two builds can be timed against an identical session.
+ */
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+
+#define REPLAY_END 0
+#define REPLAY_KEY 1
+#define REPLAY_SIZE 2
+
+typedef struct {
+	int type;
+	unsigned long frame;
+	unsigned long long us;      // since the start of the session
+	int key;
+	int scancode;
+	int action;
+	int mods;
+	int w;
+	int h;
+} ReplayEvent;
+
+typedef struct {
+	FILE* fp;
+	int recording;
+	int playing;
+	int real_time;              // replay by time instead of by frame
+	double start;
+	unsigned long frame;        // frames finished so far
+	unsigned long last_frame;   // of the previous event, events store deltas
+	unsigned long long last_us;
+	ReplayEvent next;           // read ahead while playing
+	int has_next;
+
+	double* frame_times;        // seconds, one per frame
+	size_t frame_count;
+	size_t frame_cap;
+} Replay;
+
+int replay_record(Replay* r, const char* path, double now);
+int replay_play(Replay* r, const char* path, int real_time, double now);
+void replay_key(Replay* r, double now, int key, int scancode, int action, int mods);
+void replay_size(Replay* r, double now, int w, int h);
+// next event due by this frame or time, 0 when there is none yet
+int replay_next(Replay* r, double now, ReplayEvent* e);
+void replay_frame(Replay* r, double frame_time);
+// frame count and frame time percentiles as JSON
+void replay_write_stats(const Replay* r, FILE* fp);
+// writes the end marker when recording
+void replay_close(Replay* r, double now);
+
+#endif
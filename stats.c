@@ -0,0 +1,219 @@
+/*
+ * File:   stats.c
+ * Author: Matthew
+ *
+ * Each worker counts a band of rows into its own histograms, which are merged
+ * once at the end. Every other statistic is then reduced from the 256 bins
+ * instead of from the pixels, so the image is only walked once.
+ */
+
+#include "stats.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define BINS (CHANNEL_SIZE+1)
+// interleaved sub-histograms so runs of equal values don't stall on the same counter
+#define LANES 4
+// pixels counted into 32 bit bins before they are flushed to the 64 bit ones
+#define FLUSH_PIXELS (1u << 30)
+
+typedef struct {
+	const Color* image;
+	size_t pixels;
+	size_t chunk;
+	unsigned long long (*partial)[3][BINS];
+	volatile long next;
+	int chunks;
+} StatsJob;
+
+static void count_chunk(const Color* p, size_t n, unsigned long long out[3][BINS])
+{
+	static const size_t lane_mask = LANES - 1;
+	unsigned int bins[LANES][3][BINS];
+	size_t i;
+
+	memset(bins, 0, sizeof(bins));
+	while (n > 0) {
+		size_t m = n < FLUSH_PIXELS ? n : FLUSH_PIXELS;
+
+		for (i=0; i+LANES <= m; i += LANES) {
+			for (size_t l=0; l<LANES; l++) {
+				bins[l][0][p[i+l].r]++;
+				bins[l][1][p[i+l].g]++;
+				bins[l][2][p[i+l].b]++;
+			}
+		}
+		for (; i<m; i++) {
+			bins[i & lane_mask][0][p[i].r]++;
+			bins[i & lane_mask][1][p[i].g]++;
+			bins[i & lane_mask][2][p[i].b]++;
+		}
+
+		for (int l=0; l<LANES; l++)
+			for (int c=0; c<3; c++)
+				for (int v=0; v<BINS; v++)
+					out[c][v] += bins[l][c][v];
+
+		memset(bins, 0, sizeof(bins));
+		p += m;
+		n -= m;
+	}
+}
+
+static void* stats_worker(void* arg)
+{
+	StatsJob* job = arg;
+	long long span = trace_begin();
+	long i;
+
+	while ((i = atomic_add(&job->next, 1)) < job->chunks) {
+		size_t first = (size_t) i * job->chunk;
+		size_t n = job->pixels - first < job->chunk ? job->pixels - first : job->chunk;
+		count_chunk(job->image + first, n, job->partial[i]);
+	}
+
+	trace_end("stats_histogram", span);
+	return NULL;
+}
+
+int stats_compute(ImageStats* s, const Color* image, int w, int h, int threads)
+{
+	StatsJob job;
+	thread_t* pool;
+	int started = 0;
+
+	memset(s, 0, sizeof(ImageStats));
+	if (w < 1 || h < 1)
+		return -1;
+
+	if (threads < 1)
+		threads = thread_count();
+
+	// a few chunks per thread so uneven cores still finish together
+	job.image = image;
+	job.pixels = (size_t) w*h;
+	job.chunks = threads*4;
+	job.chunk = (job.pixels + job.chunks - 1) / job.chunks;
+	if (job.chunk < 65536)
+		job.chunk = 65536;
+	job.chunks = (int) ((job.pixels + job.chunk - 1) / job.chunk);
+	job.next = 0;
+	job.partial = calloc(job.chunks, sizeof(*job.partial));
+	if (!job.partial)
+		return -1;
+
+	if (threads > job.chunks)
+		threads = job.chunks;
+
+	pool = malloc(sizeof(thread_t)*threads);
+	if (pool) {
+		for (int i=1; i<threads; i++)
+			if (thread_create(&pool[started], stats_worker, &job) == 0)
+				started++;
+	}
+	stats_worker(&job);
+	for (int i=0; i<started; i++)
+		thread_join(pool[i]);
+	free(pool);
+
+	for (int i=0; i<job.chunks; i++)
+		for (int c=0; c<3; c++)
+			for (int v=0; v<BINS; v++)
+				s->hist[c][v] += job.partial[i][c][v];
+	free(job.partial);
+
+	s->pixels = job.pixels;
+	long long span = trace_begin();
+	for (int c=0; c<3; c++) {
+		double sum = 0, sq = 0;
+
+		s->min[c] = -1;
+		for (int v=0; v<BINS; v++) {
+			if (!s->hist[c][v])
+				continue;
+			if (s->min[c] < 0)
+				s->min[c] = v;
+			s->max[c] = v;
+			sum += (double) v * s->hist[c][v];
+			sq += (double) v * v * s->hist[c][v];
+		}
+
+		s->mean[c] = sum / s->pixels;
+		s->stddev[c] = sqrt(fmax(sq / s->pixels - s->mean[c]*s->mean[c], 0));
+		s->clipped_low[c] = s->hist[c][0];
+		s->clipped_high[c] = s->hist[c][CHANNEL_SIZE];
+	}
+	trace_end("stats_reduce", span);
+
+	return 0;
+}
+
+// appends to buf, n keeps counting past the end like snprintf
+#define APPEND(...) (n += snprintf(buf + (n < size ? n : size), n < size ? size - n : 0, __VA_ARGS__))
+
+size_t stats_format_json(const ImageStats* s, char* buf, size_t size)
+{
+	static const char* names[3] = {"r", "g", "b"};
+	size_t n = 0;
+
+	if (size)
+		buf[0] = '\0';
+	APPEND("{\n  \"pixels\": %llu,\n  \"channels\": {\n", s->pixels);
+	for (int c=0; c<3; c++) {
+		APPEND("    \"%s\": {\"min\": %d, \"max\": %d, \"mean\": %.4f, \"stddev\": %.4f, "
+			"\"clipped_low\": %llu, \"clipped_high\": %llu,\n      \"histogram\": [",
+			names[c], s->min[c], s->max[c], s->mean[c], s->stddev[c],
+			s->clipped_low[c], s->clipped_high[c]);
+		for (int v=0; v<BINS; v++)
+			APPEND(v ? ",%llu" : "%llu", s->hist[c][v]);
+		APPEND(c < 2 ? "]},\n" : "]}\n");
+	}
+	APPEND("  }\n}\n");
+	return n;
+}
+
+void stats_write_json(const ImageStats* s, FILE* fp)
+{
+	char* buf = malloc(STATS_JSON_SIZE);
+
+	if (!buf)
+		return;
+	fwrite(buf, 1, stats_format_json(s, buf, STATS_JSON_SIZE), fp);
+	free(buf);
+}
+
+static void* stats_task(void* arg)
+{
+	StatsTask* t = arg;
+
+	trace_thread_name("stats");
+	stats_compute(&t->stats, t->image, t->w, t->h, t->threads);
+	atomic_store(&t->done, 1);
+	return NULL;
+}
+
+int stats_start(StatsTask* t, const Color* image, int w, int h, int threads)
+{
+	t->image = image;
+	t->w = w;
+	t->h = h;
+	t->threads = threads;
+	t->done = 0;
+	t->started = thread_create(&t->thread, stats_task, t) == 0;
+	return t->started ? 0 : -1;
+}
+
+int stats_ready(StatsTask* t)
+{
+	return t->started && atomic_load(&t->done);
+}
+
+void stats_finish(StatsTask* t)
+{
+	if (t->started)
+		thread_join(t->thread);
+	t->started = 0;
+}
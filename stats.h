@@ -0,0 +1,51 @@
+/* 
+ * File:   stats.h
+ * Author: Matthew
+ *
+ * Per-channel histogram and exposure statistics for a Color buffer.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+#include "ezview.h"
+#include "thread.h"
+
+typedef struct {
+	unsigned long long hist[3][CHANNEL_SIZE+1];
+	unsigned long long pixels;
+	int min[3];
+	int max[3];
+	double mean[3];
+	double stddev[3];
+	unsigned long long clipped_low[3];  // pixels at 0
+	unsigned long long clipped_high[3]; // pixels at CHANNEL_SIZE
+} ImageStats;
+
+// computes stats in the background so the first frame is not held up
+typedef struct {
+	ImageStats stats;
+	const Color* image;
+	int w;
+	int h;
+	int threads;
+	int started;
+	thread_t thread;
+	volatile long done;
+} StatsTask;
+
+// 20 digits for each of 768 histogram bins and room for the rest
+#define STATS_JSON_SIZE (1 << 15)
+
+int stats_compute(ImageStats* s, const Color* image, int w, int h, int threads);
+// formats the stats into buf like snprintf, STATS_JSON_SIZE always fits them
+size_t stats_format_json(const ImageStats* s, char* buf, size_t size);
+void stats_write_json(const ImageStats* s, FILE* fp);
+
+int stats_start(StatsTask* t, const Color* image, int w, int h, int threads);
+int stats_ready(StatsTask* t);
+void stats_finish(StatsTask* t);
+
+#endif
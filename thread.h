@@ -0,0 +1,120 @@
+/* 
+ * File:   thread.h
+ * Author: Matthew
+ *
+ * Minimal threading shim so the worker code builds with both cl and gcc.
+ */
+
+#ifndef THREAD_H
+#define THREAD_H
+
+#ifdef _MSC_VER
+#define inline __inline
+#endif
+
+#include <stdlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+typedef struct {
+	void* (*fn)(void*);
+	void* arg;
+} thread_start_t;
+
+static DWORD WINAPI thread_trampoline(LPVOID p)
+{
+	thread_start_t s = *(thread_start_t*) p;
+	free(p);
+	s.fn(s.arg);
+	return 0;
+}
+
+static inline int thread_create(thread_t* t, void* (*fn)(void*), void* arg)
+{
+	thread_start_t* s = malloc(sizeof(thread_start_t));
+	if (!s)
+		return -1;
+	s->fn = fn;
+	s->arg = arg;
+	*t = CreateThread(NULL, 0, thread_trampoline, s, 0, NULL);
+	if (!*t) {
+		free(s);
+		return -1;
+	}
+	return 0;
+}
+
+static inline void thread_join(thread_t t)
+{
+	WaitForSingleObject(t, INFINITE);
+	CloseHandle(t);
+}
+
+static inline int thread_count()
+{
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (int) info.dwNumberOfProcessors;
+}
+
+static inline void mutex_init(mutex_t* m) { InitializeCriticalSection(m); }
+static inline void mutex_lock(mutex_t* m) { EnterCriticalSection(m); }
+static inline void mutex_unlock(mutex_t* m) { LeaveCriticalSection(m); }
+static inline void mutex_destroy(mutex_t* m) { DeleteCriticalSection(m); }
+
+static inline void cond_init(cond_t* c) { InitializeConditionVariable(c); }
+static inline void cond_wait(cond_t* c, mutex_t* m) { SleepConditionVariableCS(c, m, INFINITE); }
+static inline void cond_broadcast(cond_t* c) { WakeAllConditionVariable(c); }
+static inline void cond_destroy(cond_t* c) { (void) c; }
+
+static inline long atomic_add(volatile long* p, long v) { return InterlockedExchangeAdd(p, v); }
+static inline long atomic_load(volatile long* p) { return InterlockedCompareExchange(p, 0, 0); }
+static inline void atomic_store(volatile long* p, long v) { InterlockedExchange(p, v); }
+
+#else
+#include <pthread.h>
+#include <unistd.h>
+
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+static inline int thread_create(thread_t* t, void* (*fn)(void*), void* arg)
+{
+	return pthread_create(t, NULL, fn, arg) ? -1 : 0;
+}
+
+static inline void thread_join(thread_t t)
+{
+	pthread_join(t, NULL);
+}
+
+static inline int thread_count()
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? (int) n : 1;
+}
+
+static inline void mutex_init(mutex_t* m) { pthread_mutex_init(m, NULL); }
+static inline void mutex_lock(mutex_t* m) { pthread_mutex_lock(m); }
+static inline void mutex_unlock(mutex_t* m) { pthread_mutex_unlock(m); }
+static inline void mutex_destroy(mutex_t* m) { pthread_mutex_destroy(m); }
+
+static inline void cond_init(cond_t* c) { pthread_cond_init(c, NULL); }
+static inline void cond_wait(cond_t* c, mutex_t* m) { pthread_cond_wait(c, m); }
+static inline void cond_broadcast(cond_t* c) { pthread_cond_broadcast(c); }
+static inline void cond_destroy(cond_t* c) { pthread_cond_destroy(c); }
+
+// returns the value before the add
+static inline long atomic_add(volatile long* p, long v) { return __atomic_fetch_add(p, v, __ATOMIC_ACQ_REL); }
+static inline long atomic_load(volatile long* p) { return __atomic_load_n(p, __ATOMIC_ACQUIRE); }
+static inline void atomic_store(volatile long* p, long v) { __atomic_store_n(p, v, __ATOMIC_RELEASE); }
+
+#endif
+
+#endif
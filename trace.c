@@ -0,0 +1,170 @@
+/*
+ * File:   trace.c
+ * Author: Matthew
+ *
+ * Each thread appends to its own chain of event blocks, so recording never
+ * takes a lock. An event only counts once it is complete and a block's next
+ * block only once it is linked, both published with release stores, so
+ * trace_write can run at exit while workers are still recording; it takes
+ * what was finished by then.
+ */
+
+#include "trace.h"
+#include "thread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+#define TRACE_TLS __declspec(thread)
+#else
+#define TRACE_TLS __thread
+#include <time.h>
+#endif
+
+#define BLOCK_EVENTS 4096
+
+typedef struct {
+	const char* name;
+	long long start;
+	long long end;
+} TraceEvent;
+
+typedef struct TraceBlock {
+	struct TraceBlock* next;   // next block of the same thread
+	struct TraceBlock* chain;  // first block of the next thread
+	const char* thread_name;   // set and read under lock
+	int tid;
+	volatile long count;       // complete events
+	volatile long linked;      // next is set
+	long seen;                 // count and linked as trace_write found them
+	struct TraceBlock* seen_next;
+	TraceEvent events[BLOCK_EVENTS];
+} TraceBlock;
+
+int trace_enabled = 0;
+
+static TRACE_TLS TraceBlock* first_block;
+static TRACE_TLS TraceBlock* last_block;
+static TraceBlock* threads;
+static int next_tid = 1;
+static mutex_t lock;
+
+void trace_start()
+{
+	mutex_init(&lock);
+	trace_enabled = 1;
+}
+
+// nanoseconds on a monotonic clock
+long long trace_now()
+{
+#ifdef _WIN32
+	static LARGE_INTEGER freq;
+	LARGE_INTEGER now;
+	if (!freq.QuadPart)
+		QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&now);
+	return (long long) (now.QuadPart * (1e9 / freq.QuadPart));
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static TraceBlock* trace_block()
+{
+	TraceBlock* b = calloc(1, sizeof(TraceBlock));
+
+	if (!b)
+		return NULL;
+
+	if (!first_block) {
+		// first event on this thread, add it to the list
+		mutex_lock(&lock);
+		b->tid = next_tid++;
+		b->chain = threads;
+		threads = b;
+		mutex_unlock(&lock);
+		first_block = b;
+	} else {
+		b->tid = first_block->tid;
+		last_block->next = b;
+		atomic_store(&last_block->linked, 1);
+	}
+
+	last_block = b;
+	return b;
+}
+
+void trace_record(const char* name, long long start)
+{
+	TraceBlock* b = last_block;
+	TraceEvent* e;
+
+	if ((!b || b->count == BLOCK_EVENTS) && !(b = trace_block()))
+		return;
+
+	e = &b->events[b->count];
+	e->name = name;
+	e->start = start;
+	e->end = trace_now();
+	atomic_store(&b->count, b->count + 1);
+}
+
+void trace_thread_name(const char* name)
+{
+	if (!trace_enabled)
+		return;
+	if (!first_block && !trace_block())
+		return;
+	mutex_lock(&lock);
+	first_block->thread_name = name;
+	mutex_unlock(&lock);
+}
+
+int trace_write(const char* path)
+{
+	FILE* fp = fopen(path, "w");
+	long long origin = -1;
+	int first = 1;
+
+	if (!fp)
+		return -1;
+
+	// other threads may still be recording, so everything finished so far is
+	// noted once and only that is written; timestamps are relative to the
+	// earliest event
+	mutex_lock(&lock);
+	for (TraceBlock* t = threads; t; t = t->chain) {
+		for (TraceBlock* b = t; b; b = b->seen_next) {
+			b->seen = atomic_load(&b->count);
+			b->seen_next = atomic_load(&b->linked) ? b->next : NULL;
+			for (int i=0; i<b->seen; i++)
+				if (origin < 0 || b->events[i].start < origin)
+					origin = b->events[i].start;
+		}
+	}
+
+	fprintf(fp, "{\"traceEvents\":[");
+	for (TraceBlock* t = threads; t; t = t->chain) {
+		if (t->thread_name) {
+			fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+				first ? "" : ",", t->tid, t->thread_name);
+			first = 0;
+		}
+		for (TraceBlock* b = t; b; b = b->seen_next) {
+			for (int i=0; i<b->seen; i++) {
+				TraceEvent* e = &b->events[i];
+				fprintf(fp, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+					first ? "" : ",", e->name, t->tid, (e->start - origin) / 1000.0, (e->end - e->start) / 1000.0);
+				first = 0;
+			}
+		}
+	}
+	mutex_unlock(&lock);
+	fprintf(fp, "\n],\"displayTimeUnit\":\"ms\"}\n");
+
+	return fclose(fp) ? -1 : 0;
+}
@@ -0,0 +1,38 @@
+/* 
+ * File:   trace.h
+ * Author: Matthew
+ *
+ * Timed spans written out as Chrome trace JSON, loadable in Perfetto or
+ * chrome://tracing. When tracing is off a span costs one branch.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef _MSC_VER
+#define inline __inline
+#endif
+
+extern int trace_enabled;
+
+// turns recording on, call before any other thread records
+void trace_start();
+long long trace_now();
+void trace_record(const char* name, long long start);
+// names the calling thread in the trace
+void trace_thread_name(const char* name);
+int trace_write(const char* path);
+
+// name must be a string literal or otherwise outlive the trace
+static inline long long trace_begin()
+{
+	return trace_enabled ? trace_now() : 0;
+}
+
+static inline void trace_end(const char* name, long long start)
+{
+	if (trace_enabled)
+		trace_record(name, start);
+}
+
+#endif
@@ -0,0 +1,347 @@
+/*
+ * File:   upload.c
+ * Author: Matthew
+ *
+ * Tightly packed 3 byte RGB rows are both a slow path on many drivers and
+ * wrong with the default 4 byte GL_UNPACK_ALIGNMENT when the width is odd.
+ * Pixels are repacked into RGBA8 or RGB565 with byte shuffles first, and the
+ * unpack alignment is always set to match the layout being sent.
+ */
+
+#include "upload.h"
+#include "pool.h"
+#include "trace.h"
+
+#include <GLFW/glfw3.h>
+
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define UPLOAD_AVX2 1
+#endif
+#if defined(__SSSE3__) || defined(__AVX2__)
+#include <tmmintrin.h>
+#define UPLOAD_SSSE3 1
+#endif
+
+#define PROBE_SIZE 1024
+#define PROBE_RUNS 3
+// starting guess for the scheduler until a band has been timed
+#define INITIAL_RATE (256.0 * 1024 * 1024)
+// largest repacked band, keeps the staging buffer cache friendly
+#define MAX_BAND_BYTES ((size_t) 4 << 20)
+
+int upload_parse_format(const char* name, UploadFormat* format)
+{
+	if (!strcmp(name, "auto"))
+		*format = UPLOAD_AUTO;
+	else if (!strcmp(name, "rgb"))
+		*format = UPLOAD_RGB;
+	else if (!strcmp(name, "rgba"))
+		*format = UPLOAD_RGBA;
+	else if (!strcmp(name, "565"))
+		*format = UPLOAD_RGB565;
+	else
+		return -1;
+	return 0;
+}
+
+const char* upload_format_name(UploadFormat format)
+{
+	switch (format) {
+		case UPLOAD_RGB: return "rgb";
+		case UPLOAD_RGBA: return "rgba";
+		case UPLOAD_RGB565: return "565";
+		default: return "auto";
+	}
+}
+
+size_t upload_pixel_size(UploadFormat format)
+{
+	return format == UPLOAD_RGBA ? 4 : (format == UPLOAD_RGB565 ? 2 : 3);
+}
+
+static void repack_rgba(const Color* src, unsigned int* dst, size_t n)
+{
+	size_t i = 0;
+
+#ifdef UPLOAD_SSSE3
+	const unsigned char* s = (const unsigned char*) src;
+	// 4 pixels per shuffle, alpha filled in by the or
+	const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha = _mm_set1_epi32((int) 0xff000000);
+#ifdef UPLOAD_AVX2
+	const __m256i spread2 = _mm256_broadcastsi128_si256(spread);
+	const __m256i alpha2 = _mm256_set1_epi32((int) 0xff000000);
+	// each 128 bit lane takes 4 pixels, the loads read 4 bytes past them
+	for (; i+10 <= n; i += 8) {
+		__m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((const __m128i*) (s + i*3))),
+			_mm_loadu_si128((const __m128i*) (s + i*3 + 12)), 1);
+		_mm256_storeu_si256((__m256i*) (dst + i), _mm256_or_si256(_mm256_shuffle_epi8(v, spread2), alpha2));
+	}
+#endif
+	for (; i+6 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (s + i*3));
+		_mm_storeu_si128((__m128i*) (dst + i), _mm_or_si128(_mm_shuffle_epi8(v, spread), alpha));
+	}
+#endif
+
+	for (; i<n; i++) {
+		unsigned char* d = (unsigned char*) (dst + i);
+		d[0] = src[i].r;
+		d[1] = src[i].g;
+		d[2] = src[i].b;
+		d[3] = 0xff;
+	}
+}
+
+static void repack_565(const Color* src, unsigned short* dst, size_t n)
+{
+	size_t i = 0;
+
+#ifdef UPLOAD_SSSE3
+	const unsigned char* s = (const unsigned char*) src;
+	// pixels 0-3 come from the first load and 4-7 from the second, one channel per 16 bit lane
+	const __m128i r_lo = _mm_setr_epi8(0, -1, 3, -1, 6, -1, 9, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i g_lo = _mm_setr_epi8(1, -1, 4, -1, 7, -1, 10, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i b_lo = _mm_setr_epi8(2, -1, 5, -1, 8, -1, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+	const __m128i r_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 4, -1, 7, -1, 10, -1, 13, -1);
+	const __m128i g_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 5, -1, 8, -1, 11, -1, 14, -1);
+	const __m128i b_hi = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, 6, -1, 9, -1, 12, -1, 15, -1);
+	const __m128i r_mask = _mm_set1_epi16((short) 0xf800);
+	const __m128i g_mask = _mm_set1_epi16(0x07e0);
+
+	for (; i+8 <= n; i += 8) {
+		__m128i lo = _mm_loadu_si128((const __m128i*) (s + i*3));
+		__m128i hi = _mm_loadu_si128((const __m128i*) (s + i*3 + 8));
+		__m128i r = _mm_or_si128(_mm_shuffle_epi8(lo, r_lo), _mm_shuffle_epi8(hi, r_hi));
+		__m128i g = _mm_or_si128(_mm_shuffle_epi8(lo, g_lo), _mm_shuffle_epi8(hi, g_hi));
+		__m128i b = _mm_or_si128(_mm_shuffle_epi8(lo, b_lo), _mm_shuffle_epi8(hi, b_hi));
+		__m128i v = _mm_or_si128(_mm_and_si128(_mm_slli_epi16(r, 8), r_mask),
+			_mm_or_si128(_mm_and_si128(_mm_slli_epi16(g, 3), g_mask), _mm_srli_epi16(b, 3)));
+		_mm_storeu_si128((__m128i*) (dst + i), v);
+	}
+#endif
+
+	for (; i<n; i++)
+		dst[i] = (unsigned short) (((src[i].r >> 3) << 11) | ((src[i].g >> 2) << 5) | (src[i].b >> 3));
+}
+
+void upload_repack(UploadFormat format, const Color* src, void* dst, size_t n)
+{
+	if (format == UPLOAD_RGBA)
+		repack_rgba(src, dst, n);
+	else if (format == UPLOAD_RGB565)
+		repack_565(src, dst, n);
+	else
+		memcpy(dst, src, n*sizeof(Color));
+}
+
+static void upload_gl_format(UploadFormat format, GLenum* layout, GLenum* type)
+{
+	*layout = format == UPLOAD_RGBA ? GL_RGBA : GL_RGB;
+	*type = format == UPLOAD_RGB565 ? GL_UNSIGNED_SHORT_5_6_5 : GL_UNSIGNED_BYTE;
+}
+
+// rows of each layout are only guaranteed this alignment
+static GLint upload_alignment(UploadFormat format)
+{
+	return format == UPLOAD_RGBA ? 4 : (format == UPLOAD_RGB565 ? 2 : 1);
+}
+
+int upload_texture(UploadFormat format, const Color* image, int w, int h)
+{
+	GLenum layout, type;
+	const void* pixels = image;
+	void* staging = NULL;
+
+	if (format != UPLOAD_RGB) {
+		staging = pool_alloc(upload_pixel_size(format) * w * h);
+		if (!staging)
+			return -1;
+		upload_repack(format, image, staging, (size_t) w*h);
+		pixels = staging;
+	}
+
+	upload_gl_format(format, &layout, &type);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, upload_alignment(format));
+	glTexImage2D(GL_TEXTURE_2D, 0, layout, w, h, 0, layout, type, pixels);
+
+	pool_free(staging);
+	return glGetError() == GL_NO_ERROR ? 0 : -1;
+}
+
+UploadFormat upload_probe()
+{
+	static const UploadFormat candidates[2] = {UPLOAD_RGB, UPLOAD_RGBA};
+	UploadFormat best = UPLOAD_RGBA;
+	double best_time = 0;
+	Color* probe = pool_alloc(sizeof(Color) * PROBE_SIZE * PROBE_SIZE);
+	GLint bound;
+	GLuint tex;
+	long long span = trace_begin();
+
+	if (!probe)
+		return best;
+	memset(probe, 0x80, sizeof(Color) * PROBE_SIZE * PROBE_SIZE);
+
+	glGetIntegerv(GL_TEXTURE_BINDING_2D, &bound);
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+
+	// best of a few runs, including the repack, after one warm up upload
+	for (int c=0; c<2; c++) {
+		upload_texture(candidates[c], probe, PROBE_SIZE, PROBE_SIZE);
+		glFinish();
+		for (int run=0; run<PROBE_RUNS; run++) {
+			double start = glfwGetTime();
+			upload_texture(candidates[c], probe, PROBE_SIZE, PROBE_SIZE);
+			glFinish();
+			double t = glfwGetTime() - start;
+			if (best_time == 0 || t < best_time) {
+				best_time = t;
+				best = candidates[c];
+			}
+		}
+	}
+
+	glDeleteTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, (GLuint) bound);
+	pool_free(probe);
+	trace_end("upload_probe", span);
+	return best;
+}
+
+void upload_scheduler_init(UploadScheduler* s, UploadFormat format, double budget)
+{
+	memset(s, 0, sizeof(UploadScheduler));
+	s->format = format;
+	s->budget = budget;
+	s->rate = INITIAL_RATE;
+
+	glGenTextures(2, s->textures);
+	for (int i=0; i<2; i++) {
+		glBindTexture(GL_TEXTURE_2D, s->textures[i]);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	}
+}
+
+void upload_scheduler_start(UploadScheduler* s, const Color* image, int w, int h)
+{
+	GLenum layout, type;
+
+	s->image = image;
+	s->w = w;
+	s->h = h;
+	s->next_row = 0;
+	s->active = 1;
+
+	// storage only, the rows arrive over the next frames
+	upload_gl_format(s->format, &layout, &type);
+	glBindTexture(GL_TEXTURE_2D, s->textures[!s->front]);
+	glTexImage2D(GL_TEXTURE_2D, 0, layout, w, h, 0, layout, type, NULL);
+}
+
+// 0 once the rows are uploaded, -1 if there was no staging memory for them
+static int upload_band(UploadScheduler* s, int rows)
+{
+	const Color* src = s->image + (size_t) s->next_row * s->w;
+	const void* pixels = src;
+	size_t n = (size_t) rows * s->w;
+	GLenum layout, type;
+	long long span = trace_begin();
+
+	if (s->format != UPLOAD_RGB) {
+		size_t bytes = upload_pixel_size(s->format) * n;
+		if (bytes > s->staging_size) {
+			pool_free(s->staging);
+			s->staging = pool_alloc(bytes);
+			s->staging_size = s->staging ? bytes : 0;
+		}
+		if (!s->staging)
+			return -1;
+		upload_repack(s->format, src, s->staging, n);
+		pixels = s->staging;
+	}
+
+	upload_gl_format(s->format, &layout, &type);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, s->next_row, s->w, rows, layout, type, pixels);
+	trace_end("upload_band", span);
+	return 0;
+}
+
+int upload_scheduler_step(UploadScheduler* s)
+{
+	size_t row_bytes;
+	int max_rows;
+	double start, elapsed;
+
+	if (!s->active)
+		return 0;
+
+	row_bytes = upload_pixel_size(s->format) * s->w;
+	max_rows = (int) (MAX_BAND_BYTES / row_bytes);
+	if (max_rows < 1)
+		max_rows = 1;
+
+	glBindTexture(GL_TEXTURE_2D, s->textures[!s->front]);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, upload_alignment(s->format));
+
+	start = glfwGetTime();
+	elapsed = 0;
+	// size each band to what the measured rate says fits in the budget left,
+	// always moving at least one row so a slow driver still finishes
+	do {
+		int rows = (int) (s->rate * (s->budget - elapsed) / row_bytes);
+		double band_start;
+
+		if (rows < 1)
+			rows = 1;
+		if (rows > max_rows)
+			rows = max_rows;
+		if (rows > s->h - s->next_row)
+			rows = s->h - s->next_row;
+
+		// the texture storage is already in the repacked format, so without
+		// staging memory the rows are left for the next frame to try again
+		band_start = glfwGetTime();
+		if (upload_band(s, rows))
+			return 0;
+		double t = glfwGetTime() - band_start;
+		if (t > 0)
+			s->rate = s->rate * 0.75 + (rows * row_bytes / t) * 0.25;
+
+		s->next_row += rows;
+		elapsed = glfwGetTime() - start;
+	} while (s->next_row < s->h && elapsed < s->budget);
+
+	if (s->next_row < s->h)
+		return 0;
+
+	// every row is in, show it from the next draw on
+	s->front = !s->front;
+	s->ready = 1;
+	s->active = 0;
+	s->image = NULL;
+	pool_free(s->staging);
+	s->staging = NULL;
+	s->staging_size = 0;
+	return 1;
+}
+
+GLuint upload_scheduler_texture(const UploadScheduler* s)
+{
+	return s->textures[s->front];
+}
+
+void upload_scheduler_destroy(UploadScheduler* s)
+{
+	glDeleteTextures(2, s->textures);
+	pool_free(s->staging);
+	memset(s, 0, sizeof(UploadScheduler));
+}
@@ -0,0 +1,58 @@
+/* 
+ * File:   upload.h
+ * Author: Matthew
+ *
+ * Texture upload in whichever pixel layout the driver takes fastest.
+ */
+
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stddef.h>
+#include <GLES2/gl2.h>
+
+#include "ezview.h"
+
+typedef enum {
+	UPLOAD_AUTO = -1,
+	UPLOAD_RGB,     // the decoded layout, uploaded as is
+	UPLOAD_RGBA,    // padded to 4 bytes, the native layout on most drivers
+	UPLOAD_RGB565   // half the memory of RGBA for constrained devices
+} UploadFormat;
+
+int upload_parse_format(const char* name, UploadFormat* format);
+const char* upload_format_name(UploadFormat format);
+// times a test upload of each full precision layout and returns the fastest
+UploadFormat upload_probe();
+
+size_t upload_pixel_size(UploadFormat format);
+void upload_repack(UploadFormat format, const Color* src, void* dst, size_t n);
+// repacks and uploads image into the bound GL_TEXTURE_2D
+int upload_texture(UploadFormat format, const Color* image, int w, int h);
+
+// uploads an image a band of rows at a time into a back texture, then swaps
+typedef struct {
+	UploadFormat format;
+	GLuint textures[2];
+	int front;          // texture being displayed
+	int ready;          // front holds a complete image
+	int active;         // an upload into the back texture is in progress
+	const Color* image;
+	int w;
+	int h;
+	int next_row;
+	double budget;      // seconds of upload per frame
+	double rate;        // measured upload bytes per second
+	void* staging;      // repacked band
+	size_t staging_size;
+} UploadScheduler;
+
+void upload_scheduler_init(UploadScheduler* s, UploadFormat format, double budget);
+// image must stay valid until upload_scheduler_step reports the swap
+void upload_scheduler_start(UploadScheduler* s, const Color* image, int w, int h);
+// uploads bands until the frame budget is spent, returns 1 on the frame the new image is swapped in
+int upload_scheduler_step(UploadScheduler* s);
+GLuint upload_scheduler_texture(const UploadScheduler* s);
+void upload_scheduler_destroy(UploadScheduler* s);
+
+#endif
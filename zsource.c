@@ -0,0 +1,332 @@
+/*
+ * File:   zsource.c
+ * Author: Matthew
+ *
+ * The decompression thread fills ring blocks in order and the reader drains
+ * them in order; one lock guards the two counters and is only taken once
+ * per block on each side.
+ */
+
+#include "zsource.h"
+#include "thread.h"
+#include "trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// compressed bytes read from the file at a time
+#define INPUT_SIZE (1 << 16)
+
+struct ZSource {
+	FILE* fp;
+	int kind;
+	unsigned char* input;
+	unsigned char* slots[ZSOURCE_SLOTS];
+	size_t fill[ZSOURCE_SLOTS];
+
+	// blocks produced and consumed so far, guarded by lock
+	long head;
+	long tail;
+	int done;
+	int stop;
+	mutex_t lock;
+	cond_t cond;
+
+	size_t pos;             // read position in the tail block, reader only
+	thread_t thread;
+	int started;
+	int failed;             // corrupt or truncated data, the reader sees an early end
+	char error[96];         // why, set before done
+};
+
+int zsource_detect(const unsigned char* magic, size_t len)
+{
+	if (len >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+		return ZSOURCE_GZIP;
+	if (len >= 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+		return ZSOURCE_ZSTD;
+	return ZSOURCE_NONE;
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+static void zsource_fail(ZSource* z, const char* what, const char* detail)
+{
+	snprintf(z->error, sizeof(z->error), "%s%s%s.", what, detail ? ": " : "", detail ? detail : "");
+	z->failed = 1;
+}
+
+// waits for a free block, NULL when the reader has gone away
+static unsigned char* next_block(ZSource* z)
+{
+	unsigned char* block = NULL;
+
+	mutex_lock(&z->lock);
+	while (!z->stop && z->head - z->tail == ZSOURCE_SLOTS)
+		cond_wait(&z->cond, &z->lock);
+	if (!z->stop)
+		block = z->slots[z->head % ZSOURCE_SLOTS];
+	mutex_unlock(&z->lock);
+	return block;
+}
+
+static void publish_block(ZSource* z, size_t n)
+{
+	mutex_lock(&z->lock);
+	z->fill[z->head % ZSOURCE_SLOTS] = n;
+	z->head++;
+	cond_broadcast(&z->cond);
+	mutex_unlock(&z->lock);
+}
+#endif
+
+#ifdef HAVE_ZLIB
+static void inflate_gzip(ZSource* z)
+{
+	z_stream s;
+	int status = Z_OK;
+	int eof = 0;
+	unsigned char* block;
+
+	memset(&s, 0, sizeof(s));
+	// 32 lets zlib take the gzip header
+	if (inflateInit2(&s, 15 + 32) != Z_OK) {
+		zsource_fail(z, "Could not start gzip decompression", NULL);
+		return;
+	}
+
+	while (status != Z_STREAM_END && !z->failed && (block = next_block(z))) {
+		long long span = trace_begin();
+		s.next_out = block;
+		s.avail_out = ZSOURCE_BLOCK;
+
+		while (s.avail_out > 0) {
+			if (s.avail_in == 0 && !eof) {
+				s.next_in = z->input;
+				s.avail_in = (uInt) fread(z->input, 1, INPUT_SIZE, z->fp);
+				eof = s.avail_in == 0;
+			}
+			status = inflate(&s, Z_NO_FLUSH);
+			if (status == Z_STREAM_END) {
+				int c = s.avail_in > 0 ? 0 : fgetc(z->fp);
+				if (c == EOF)
+					break;
+				if (s.avail_in == 0)
+					ungetc(c, z->fp);
+				// concatenated members carry on into the next one
+				inflateReset(&s);
+				status = Z_OK;
+			} else if (status == Z_BUF_ERROR && eof) {
+				zsource_fail(z, "Truncated gzip data", NULL);
+				break;
+			} else if (status != Z_OK) {
+				zsource_fail(z, "Corrupt gzip data", s.msg);
+				break;
+			}
+		}
+
+		trace_end("inflate_block", span);
+		publish_block(z, ZSOURCE_BLOCK - s.avail_out);
+	}
+
+	inflateEnd(&s);
+}
+#endif
+
+#ifdef HAVE_ZSTD
+static void inflate_zstd(ZSource* z)
+{
+	ZSTD_DStream* s = ZSTD_createDStream();
+	ZSTD_inBuffer in = {z->input, 0, 0};
+	size_t status = 1;
+	int eof = 0;
+	unsigned char* block;
+
+	if (!s || ZSTD_isError(ZSTD_initDStream(s))) {
+		zsource_fail(z, "Could not start zstd decompression", NULL);
+		ZSTD_freeDStream(s);
+		return;
+	}
+
+	while (!eof && !z->failed && (block = next_block(z))) {
+		long long span = trace_begin();
+		ZSTD_outBuffer out = {block, ZSOURCE_BLOCK, 0};
+
+		while (out.pos < out.size) {
+			size_t before = out.pos;
+			if (in.pos == in.size) {
+				in.size = fread(z->input, 1, INPUT_SIZE, z->fp);
+				in.pos = 0;
+			}
+			// 0 marks the end of a frame, more frames may follow
+			status = ZSTD_decompressStream(s, &out, &in);
+			if (ZSTD_isError(status)) {
+				zsource_fail(z, "Corrupt zstd data", ZSTD_getErrorName(status));
+				break;
+			}
+			// nothing left to read and nothing more flushed out
+			if (in.size == 0 && out.pos == before) {
+				eof = 1;
+				if (status != 0)
+					zsource_fail(z, "Truncated zstd data", NULL);
+				break;
+			}
+		}
+
+		trace_end("inflate_block", span);
+		publish_block(z, out.pos);
+	}
+
+	ZSTD_freeDStream(s);
+}
+#endif
+
+static void* zsource_worker(void* arg)
+{
+	ZSource* z = arg;
+	long long span = trace_begin();
+
+	trace_thread_name("inflate");
+#ifdef HAVE_ZLIB
+	if (z->kind == ZSOURCE_GZIP)
+		inflate_gzip(z);
+#endif
+#ifdef HAVE_ZSTD
+	if (z->kind == ZSOURCE_ZSTD)
+		inflate_zstd(z);
+#endif
+	trace_end("decompress", span);
+
+	mutex_lock(&z->lock);
+	z->done = 1;
+	cond_broadcast(&z->cond);
+	mutex_unlock(&z->lock);
+	return NULL;
+}
+
+ZSource* zsource_open(FILE* fp, int kind, char* error, size_t error_size)
+{
+	ZSource* z;
+
+#ifndef HAVE_ZLIB
+	if (kind == ZSOURCE_GZIP) {
+		snprintf(error, error_size, "Built without gzip support.");
+		return NULL;
+	}
+#endif
+#ifndef HAVE_ZSTD
+	if (kind == ZSOURCE_ZSTD) {
+		snprintf(error, error_size, "Built without zstd support.");
+		return NULL;
+	}
+#endif
+
+	z = calloc(1, sizeof(ZSource));
+	if (!z) {
+		snprintf(error, error_size, "Out of memory.");
+		return NULL;
+	}
+	z->fp = fp;
+	z->kind = kind;
+	z->input = malloc(INPUT_SIZE);
+	for (int i=0; i<ZSOURCE_SLOTS; i++)
+		z->slots[i] = malloc(ZSOURCE_BLOCK);
+	mutex_init(&z->lock);
+	cond_init(&z->cond);
+
+	int ok = z->input != NULL;
+	for (int i=0; i<ZSOURCE_SLOTS; i++)
+		ok = ok && z->slots[i] != NULL;
+	if (ok && thread_create(&z->thread, zsource_worker, z) == 0)
+		z->started = 1;
+
+	if (!z->started) {
+		snprintf(error, error_size, "Could not start decompression.");
+		z->fp = NULL;
+		zsource_close(z);
+		return NULL;
+	}
+	return z;
+}
+
+size_t zsource_read(void* user, void* buf, size_t len)
+{
+	ZSource* z = user;
+	size_t n;
+	unsigned char* block;
+
+	mutex_lock(&z->lock);
+	for (;;) {
+		// hand a drained block back to the decompression thread
+		if (z->tail < z->head && z->pos == z->fill[z->tail % ZSOURCE_SLOTS]) {
+			z->tail++;
+			z->pos = 0;
+			cond_broadcast(&z->cond);
+			continue;
+		}
+		if (z->tail < z->head)
+			break;
+		if (z->done) {
+			mutex_unlock(&z->lock);
+			return 0;
+		}
+		cond_wait(&z->cond, &z->lock);
+	}
+	n = z->fill[z->tail % ZSOURCE_SLOTS] - z->pos;
+	block = z->slots[z->tail % ZSOURCE_SLOTS];
+	mutex_unlock(&z->lock);
+
+	// the block is the reader's until tail moves past it
+	if (n > len)
+		n = len;
+	memcpy(buf, block + z->pos, n);
+	z->pos += n;
+	return n;
+}
+
+const char* zsource_status(void* user)
+{
+	ZSource* z = user;
+
+	mutex_lock(&z->lock);
+	while (!z->done) {
+		if (z->tail < z->head) {
+			z->tail++;
+			z->pos = 0;
+			cond_broadcast(&z->cond);
+		} else {
+			cond_wait(&z->cond, &z->lock);
+		}
+	}
+	mutex_unlock(&z->lock);
+	return z->failed ? z->error : NULL;
+}
+
+void zsource_close(void* user)
+{
+	ZSource* z = user;
+
+	if (!z)
+		return;
+	mutex_lock(&z->lock);
+	z->stop = 1;
+	cond_broadcast(&z->cond);
+	mutex_unlock(&z->lock);
+	if (z->started)
+		thread_join(z->thread);
+
+	if (z->fp)
+		fclose(z->fp);
+	for (int i=0; i<ZSOURCE_SLOTS; i++)
+		free(z->slots[i]);
+	free(z->input);
+	mutex_destroy(&z->lock);
+	cond_destroy(&z->cond);
+	free(z);
+}
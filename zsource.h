@@ -0,0 +1,39 @@
+/* 
+ * File:   zsource.h
+ * Author: Matthew
+ *
+ * gzip and zstd compressed sources for the PpmDecoder. A thread decompresses
+ * into a small ring of blocks while the decoder parses the ones before, so
+ * compressed files never touch the disk uncompressed.
+ */
+
+#ifndef ZSOURCE_H
+#define ZSOURCE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define ZSOURCE_NONE 0
+#define ZSOURCE_GZIP 1
+#define ZSOURCE_ZSTD 2
+
+// decompressed bytes per ring block and blocks in the ring
+#define ZSOURCE_BLOCK (1 << 18)
+#define ZSOURCE_SLOTS 4
+
+typedef struct ZSource ZSource;
+
+// kind of compression from the first bytes of a file
+int zsource_detect(const unsigned char* magic, size_t len);
+// takes over fp, positioned at the start of the compressed data, and starts
+// the decompression thread; NULL with error filled in on failure
+ZSource* zsource_open(FILE* fp, int kind, char* error, size_t error_size);
+// ppm_read_fn, blocks until decompressed data is ready, 0 at the end or on error
+size_t zsource_read(void* user, void* buf, size_t len);
+// ppm status callback: skips whatever hasn't been read, waits for the end of
+// the stream and returns why it was corrupt or truncated, or NULL if it wasn't
+const char* zsource_status(void* user);
+// stops the thread early if need be and closes the file
+void zsource_close(void* user);
+
+#endif